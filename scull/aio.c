@@ -0,0 +1,122 @@
+#include <linux/fs.h>
+#include <linux/kthread.h>
+#include <linux/module.h>
+#include <linux/sched/mm.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/workqueue.h>
+
+#include "scull.h"
+
+/*
+ * Asynchronous reads and writes.
+ * An asynchronous request (AIO, io_uring) of at least scull_aio_min bytes
+ * is queued to an unbound workqueue and -EIOCBQUEUED is returned, so that
+ * one thread can keep many large transfers in flight. The worker copies
+ * under the mm of the submitter, charging its cgroup for QoS, and completes
+ * the kiocb. Other requests are served synchronously.
+ */
+
+static unsigned int scull_aio_min = 256 * 1024; /* 0 to never queue */
+
+module_param(scull_aio_min, uint, 0644);
+
+struct scull_aio {
+	struct work_struct work;
+	struct kiocb *iocb;
+	struct iov_iter iter;
+	const void *iov; /* Copy of the segments of iter, if any */
+	struct mm_struct *mm;
+	u64 cgid; /* cgroup of the submitter, charged for the transfer */
+	bool write;
+};
+
+static struct workqueue_struct *scull_aio_wq;
+
+bool scull_aio_async(struct kiocb *iocb, struct iov_iter *iter)
+{
+	unsigned int min = READ_ONCE(scull_aio_min);
+
+	return !is_sync_kiocb(iocb) && min && iov_iter_count(iter) >= min &&
+	       user_backed_iter(iter) && current->mm;
+}
+
+static void scull_aio_work(struct work_struct *work)
+{
+	struct scull_aio *aio = container_of(work, struct scull_aio, work);
+	struct kiocb *iocb = aio->iocb;
+	ssize_t ret = -EFAULT;
+
+	/* the address space is gone if the submitter exited meanwhile */
+	if (mmget_not_zero(aio->mm)) {
+		kthread_use_mm(aio->mm);
+		if (aio->write) {
+			ret = scull_do_write(iocb->ki_filp, &aio->iter,
+					     &iocb->ki_pos, aio->cgid);
+		} else {
+			ret = scull_do_read(iocb->ki_filp, &aio->iter,
+					    &iocb->ki_pos, aio->cgid);
+		}
+		kthread_unuse_mm(aio->mm);
+		mmput(aio->mm);
+	}
+	if (ret == -ERESTARTSYS) {
+		ret = -EINTR;
+	}
+
+	mmdrop(aio->mm);
+	kfree(aio->iov);
+	kfree(aio);
+
+	iocb->ki_complete(iocb, ret);
+}
+
+/*
+ * Queue a request to the worker. The segments of iter belong to the
+ * submitter and are copied.
+ */
+ssize_t scull_aio_queue(struct kiocb *iocb, struct iov_iter *iter, bool write)
+{
+	struct scull_aio *aio = kzalloc(sizeof(*aio), GFP_KERNEL);
+
+	if (!aio) {
+		return -ENOMEM;
+	}
+
+	if (iter_is_ubuf(iter)) {
+		aio->iter = *iter;
+	} else {
+		aio->iov = dup_iter(&aio->iter, iter, GFP_KERNEL);
+		if (!aio->iov) {
+			kfree(aio);
+			return -ENOMEM;
+		}
+	}
+
+	aio->iocb = iocb;
+	aio->write = write;
+	aio->cgid = scull_qos_cgroup_id();
+	aio->mm = current->mm;
+	mmgrab(aio->mm);
+	INIT_WORK(&aio->work, scull_aio_work);
+	queue_work(scull_aio_wq, &aio->work);
+
+	return -EIOCBQUEUED;
+}
+
+int scull_aio_init(void)
+{
+	scull_aio_wq = alloc_workqueue("scull_aio", WQ_UNBOUND, 0);
+	if (!scull_aio_wq) {
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void scull_aio_cleanup(void)
+{
+	if (scull_aio_wq) {
+		destroy_workqueue(scull_aio_wq);
+		scull_aio_wq = NULL;
+	}
+}
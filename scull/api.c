@@ -0,0 +1,158 @@
+#include <linux/err.h>
+#include <linux/module.h>
+#include <linux/uio.h>
+
+#include "scull.h"
+#include "scull_trace.h"
+
+/*
+ * Kernel API, for modules that stage data in scull devices without going
+ * through the VFS. Devices are found by index with scull_get_device.
+ * Reads and writes take kernel buffers or any iov_iter, such as kvec or
+ * bvec ones. They take dev->lock and share the storage, statistics,
+ * latency histograms and tracepoints of the character device, with a NULL
+ * file. QoS limits and I/O delays only apply to the character device.
+ * Positions are checked like file offsets: negative ones, and those past
+ * the addressable size of the device, give -EINVAL.
+ *
+ * scull_borrow gives direct access to the quantum holding a position,
+ * for zero copy. dev->lock is held until scull_return, so the quantum can
+ * neither be freed nor accessed by anyone else meanwhile: borrowers must
+ * not sleep for long nor call back into scull.
+ */
+
+ssize_t scull_read_iter_at(struct scull_dev *dev, struct iov_iter *iter,
+			   loff_t pos)
+{
+	size_t count = iov_iter_count(iter);
+
+	if (pos < 0) {
+		return -EINVAL;
+	}
+
+	u64 start = ktime_get_ns();
+
+	scull_lock(dev);
+	ssize_t ret = scull_copy_to_iter(dev, iter, pos);
+	scull_unlock(dev);
+
+	u64 ns = ktime_get_ns() - start;
+	scull_lat_record(dev, SCULL_LAT_READ, ns);
+	trace_scull_read(MINOR(dev->cdev.dev), NULL, pos, count, ret, ns);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(scull_read_iter_at);
+
+ssize_t scull_write_iter_at(struct scull_dev *dev, struct iov_iter *iter,
+			    loff_t pos)
+{
+	size_t count = iov_iter_count(iter);
+
+	if (pos < 0) {
+		return -EINVAL;
+	}
+
+	u64 start = ktime_get_ns();
+
+	scull_lock(dev);
+	ssize_t ret = scull_copy_from_iter(dev, iter, pos);
+	scull_unlock(dev);
+
+	u64 ns = ktime_get_ns() - start;
+	scull_lat_record(dev, SCULL_LAT_WRITE, ns);
+	trace_scull_write(MINOR(dev->cdev.dev), NULL, pos, count, ret, ns);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(scull_write_iter_at);
+
+ssize_t scull_kernel_read(struct scull_dev *dev, void *buf, size_t count,
+			  loff_t pos)
+{
+	struct kvec kv = { .iov_base = buf, .iov_len = count };
+	struct iov_iter iter;
+
+	iov_iter_kvec(&iter, ITER_DEST, &kv, 1, count);
+	return scull_read_iter_at(dev, &iter, pos);
+}
+EXPORT_SYMBOL_GPL(scull_kernel_read);
+
+ssize_t scull_kernel_write(struct scull_dev *dev, const void *buf,
+			   size_t count, loff_t pos)
+{
+	struct kvec kv = { .iov_base = (void *)buf, .iov_len = count };
+	struct iov_iter iter;
+
+	iov_iter_kvec(&iter, ITER_SOURCE, &kv, 1, count);
+	return scull_write_iter_at(dev, &iter, pos);
+}
+EXPORT_SYMBOL_GPL(scull_kernel_write);
+
+/*
+ * Lend the quantum holding pos, from pos to the end of the quantum, or of
+ * the device when reading. For writing, the quantum is allocated if
+ * needed. Returns with dev->lock held, or a negative error: -ENXIO when
+ * reading past the end of the device, -ENOMEM.
+ */
+int scull_borrow(struct scull_dev *dev, loff_t pos, bool write,
+		 struct scull_borrow *b)
+{
+	if (pos < 0) {
+		return -EINVAL;
+	}
+
+	scull_lock(dev);
+
+	if (!write && pos >= dev->size) {
+		scull_unlock(dev);
+		return -ENXIO;
+	}
+
+	void *data = scull_quantum_at(dev, pos, write);
+	if (IS_ERR(data)) {
+		scull_unlock(dev);
+		return PTR_ERR(data);
+	}
+
+	size_t q_pos = pos % dev->quantum;
+
+	b->dev = dev;
+	b->data = data ? data + q_pos : NULL;
+	b->len = dev->quantum - q_pos;
+	if (!write) {
+		b->len = min_t(loff_t, b->len, dev->size - pos);
+	}
+	b->pos = pos;
+	b->write = write;
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(scull_borrow);
+
+/*
+ * Give back a borrowed quantum, written is the number of bytes written
+ * from the start of the borrowed range.
+ */
+void scull_return(struct scull_borrow *b, size_t written)
+{
+	struct scull_dev *dev = b->dev;
+
+	if (b->write) {
+		written = min(written, b->len);
+		if (written && dev->size < b->pos + written) {
+			dev->size = b->pos + written;
+		}
+		scull_heat_record(dev, true, b->pos, written);
+		scull_stat_inc(dev, writes);
+		scull_stat_add(dev, write_bytes, written);
+	} else {
+		scull_heat_record(dev, false, b->pos, b->len);
+		scull_stat_inc(dev, reads);
+		scull_stat_add(dev, read_bytes, b->len);
+	}
+
+	scull_unlock(dev);
+	b->data = NULL;
+}
+EXPORT_SYMBOL_GPL(scull_return);
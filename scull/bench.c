@@ -0,0 +1,187 @@
+#include <linux/debugfs.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+
+#include "scull.h"
+
+/*
+ * Microbenchmarks of the storage engine, built in with "make bench".
+ * Reading the bench debugfs file runs them on a private device of each of
+ * the sizes below, and reports the time per operation of:
+ *   write   sequential writes of SCULL_BENCH_CHUNK bytes
+ *   read    sequential reads of SCULL_BENCH_CHUNK bytes
+ *   lookup  scull_follow of a random item, the random draw included
+ *   trim    scull_trim of the whole device, per quantum freed
+ */
+
+#define SCULL_BENCH_CHUNK (64 * 1024)
+#define SCULL_BENCH_LOOKUPS 100000
+
+static const int scull_bench_sizes_mb[] = { 1, 16, 64 };
+
+static struct scull_dev *scull_bench_alloc(void)
+{
+	struct scull_dev *dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+
+	if (!dev) {
+		return NULL;
+	}
+
+	dev->quantum = SCULL_QUANTUM;
+	dev->qset = SCULL_QSET;
+	mutex_init(&dev->lock);
+	scull_heat_reset(dev);
+	dev->stats = alloc_percpu(struct scull_stats);
+	dev->lat = alloc_percpu(struct scull_latency);
+	if (!dev->stats || !dev->lat) {
+		free_percpu(dev->lat);
+		free_percpu(dev->stats);
+		kfree(dev);
+		return NULL;
+	}
+
+	return dev;
+}
+
+static void scull_bench_free(struct scull_dev *dev)
+{
+	scull_lock(dev);
+	scull_trim(dev);
+	scull_unlock(dev);
+
+	free_percpu(dev->lat);
+	free_percpu(dev->stats);
+	kfree(dev);
+}
+
+/*
+ * Transfer the first size bytes of the device, chunk by chunk.
+ * Returns the time spent in ns, or a negative error.
+ */
+static s64 scull_bench_rw(struct scull_dev *dev, void *buf, size_t size,
+			  bool write)
+{
+	u64 start = ktime_get_ns();
+
+	for (loff_t pos = 0; pos < size; pos += SCULL_BENCH_CHUNK) {
+		struct kvec kv = { .iov_base = buf,
+				   .iov_len = SCULL_BENCH_CHUNK };
+		struct iov_iter iter;
+		ssize_t ret;
+
+		iov_iter_kvec(&iter, write ? ITER_SOURCE : ITER_DEST, &kv, 1,
+			      SCULL_BENCH_CHUNK);
+
+		scull_lock(dev);
+		if (write) {
+			ret = scull_copy_from_iter(dev, &iter, pos);
+		} else {
+			ret = scull_copy_to_iter(dev, &iter, pos);
+		}
+		scull_unlock(dev);
+
+		if (ret != SCULL_BENCH_CHUNK) {
+			return ret < 0 ? ret : -EIO;
+		}
+		cond_resched();
+	}
+
+	return ktime_get_ns() - start;
+}
+
+static s64 scull_bench_lookup(struct scull_dev *dev, size_t size)
+{
+	u32 items = DIV_ROUND_UP(size, (size_t)dev->quantum * dev->qset);
+	s64 ret;
+
+	scull_lock(dev);
+	u64 start = ktime_get_ns();
+	for (int i = 0; i < SCULL_BENCH_LOOKUPS; i++) {
+		if (!scull_follow(dev, get_random_u32_below(items))) {
+			scull_unlock(dev);
+			return -ENOMEM;
+		}
+	}
+	ret = ktime_get_ns() - start;
+	scull_unlock(dev);
+
+	return ret;
+}
+
+static s64 scull_bench_trim(struct scull_dev *dev)
+{
+	s64 ret;
+
+	scull_lock(dev);
+	u64 start = ktime_get_ns();
+	scull_trim(dev);
+	ret = ktime_get_ns() - start;
+	scull_unlock(dev);
+
+	return ret;
+}
+
+static void scull_bench_report(struct seq_file *s, int size_mb,
+			       const char *op, s64 ns, u64 ops)
+{
+	if (ns < 0) {
+		seq_printf(s, "%4d MiB %-6s error %lld\n", size_mb, op, ns);
+	} else {
+		seq_printf(s, "%4d MiB %-6s %10llu ns/op (%llu ops)\n", size_mb,
+			   op, div64_u64(ns, ops), ops);
+	}
+}
+
+static int scull_bench_show(struct seq_file *s, void *v)
+{
+	void *buf = kmalloc(SCULL_BENCH_CHUNK, GFP_KERNEL);
+
+	if (!buf) {
+		return -ENOMEM;
+	}
+	memset(buf, 0x5a, SCULL_BENCH_CHUNK);
+
+	for (int i = 0; i < ARRAY_SIZE(scull_bench_sizes_mb); i++) {
+		int size_mb = scull_bench_sizes_mb[i];
+		size_t size = (size_t)size_mb << 20;
+		u64 chunks = size / SCULL_BENCH_CHUNK;
+		struct scull_dev *dev = scull_bench_alloc();
+
+		if (!dev) {
+			kfree(buf);
+			return -ENOMEM;
+		}
+
+		scull_bench_report(s, size_mb, "write",
+				   scull_bench_rw(dev, buf, size, true),
+				   chunks);
+		scull_bench_report(s, size_mb, "read",
+				   scull_bench_rw(dev, buf, size, false),
+				   chunks);
+		scull_bench_report(s, size_mb, "lookup",
+				   scull_bench_lookup(dev, size),
+				   SCULL_BENCH_LOOKUPS);
+
+		u64 quanta = max_t(u64, dev->mem.quanta, 1);
+		scull_bench_report(s, size_mb, "trim", scull_bench_trim(dev),
+				   quanta);
+
+		scull_bench_free(dev);
+	}
+
+	kfree(buf);
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(scull_bench);
+
+void scull_bench_init(struct dentry *root)
+{
+	debugfs_create_file("bench", 0400, root, NULL, &scull_bench_fops);
+}
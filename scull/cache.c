@@ -0,0 +1,526 @@
+#include <linux/module.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "scull.h"
+
+/*
+ * In cache mode, a scull device is an in-memory cache over a regular file.
+ * Missing quanta are read from the file on access, written quanta are
+ * marked dirty and a delayed work writes them back in offset order,
+ * coalescing contiguous dirty quanta in a single write.
+ * When the number of resident quanta reaches scull_cache_quanta, clean
+ * quanta are evicted in a round-robin fashion.
+ *
+ * A batch is written back without dev->lock: its quanta are pinned by a
+ * reference to their pages, and are only marked clean afterwards if they
+ * were not written meanwhile. Trims wait for the batch in flight, and
+ * holes are not punched in its range of the file, so that it cannot land
+ * over newer contents.
+ */
+
+static char *scull_backing[SCULL_NUM_DEVS];
+static int scull_cache_quanta = 0; /* Max resident quanta, 0 for no limit */
+static int scull_writeback_ms = 5000;
+static int scull_writeback_batch = 256; /* Max quanta per write */
+
+module_param_array(scull_backing, charp, NULL, S_IRUGO);
+module_param(scull_cache_quanta, int, S_IRUGO);
+module_param(scull_writeback_ms, int, S_IRUGO);
+module_param(scull_writeback_batch, int, S_IRUGO);
+
+struct scull_cache_slot {
+	struct scull_qset *dptr;
+	int s_pos;
+	void *data;
+	u64 gen; /* Write generation when pinned */
+};
+
+struct scull_cache {
+	struct scull_dev *dev;
+	struct file *file;
+	struct delayed_work work;
+	struct mutex wb_lock; /* One batch in flight at a time */
+	struct kvec *vecs; /* Write back batch */
+	struct scull_cache_slot *slots; /* Quanta of the batch */
+	loff_t wb_start, wb_end; /* Batch in flight, if not empty */
+	wait_queue_head_t wb_wait; /* Woken when the batch is done */
+	unsigned long nr_resident; /* Quanta in memory */
+	unsigned long nr_dirty; /* Quanta to write back */
+	/* Where eviction resumes, valid while evict_trim_gen is */
+	struct scull_qset *evict_dptr;
+	int evict_s_pos;
+	u64 evict_trim_gen;
+	int err; /* Write back error, reported by next fsync */
+};
+
+/* Position of a write back pass, valid while trim_gen is */
+struct scull_cache_cursor {
+	loff_t pos;
+	struct scull_qset *dptr; /* qset of pos */
+	int s_pos;
+	u64 trim_gen;
+};
+
+static void scull_cache_pin(struct scull_dev *dev, void *data)
+{
+	for (int off = 0; off < dev->quantum; off += PAGE_SIZE) {
+		get_page(virt_to_page(data + off));
+	}
+}
+
+static void scull_cache_unpin(struct scull_dev *dev, void *data)
+{
+	for (int off = 0; off < dev->quantum; off += PAGE_SIZE) {
+		put_page(virt_to_page(data + off));
+	}
+}
+
+/*
+ * Pin the first run of dirty quanta at or after the cursor as the batch in
+ * flight, and move the cursor past it. Returns the number of quanta.
+ * Must be called with lock held.
+ */
+static int scull_cache_pin_batch(struct scull_dev *dev,
+				 struct scull_cache_cursor *cur, size_t *len)
+{
+	struct scull_cache *cache = dev->cache;
+	int quantum = dev->quantum;
+	int qset = dev->qset;
+
+	if (!cache->nr_dirty || cur->trim_gen != dev->trim_gen) {
+		return 0;
+	}
+
+	struct scull_qset *dptr = cur->dptr;
+	int s_pos = cur->s_pos;
+	loff_t pos = cur->pos;
+	int nr = 0;
+
+	*len = 0;
+	while (dptr && pos < dev->size && nr < scull_writeback_batch) {
+		if (dptr->dirty && test_bit(s_pos, dptr->dirty)) {
+			struct scull_cache_slot *slot = &cache->slots[nr];
+
+			if (!nr) {
+				cache->wb_start = pos;
+			}
+			slot->dptr = dptr;
+			slot->s_pos = s_pos;
+			slot->data = dptr->data[s_pos];
+			slot->gen = dptr->gen[s_pos];
+			scull_cache_pin(dev, slot->data);
+
+			cache->vecs[nr].iov_base = slot->data;
+			cache->vecs[nr].iov_len =
+				min_t(loff_t, quantum, dev->size - pos);
+			*len += cache->vecs[nr].iov_len;
+			nr++;
+		} else if (nr) {
+			break;
+		}
+
+		pos += quantum;
+		if (++s_pos == qset) {
+			s_pos = 0;
+			dptr = dptr->next;
+		}
+	}
+
+	cur->pos = pos;
+	cur->dptr = dptr;
+	cur->s_pos = s_pos;
+	if (nr) {
+		cache->wb_end = pos;
+	}
+	return nr;
+}
+
+/*
+ * Mark the quanta of the batch clean if it was written and they were not
+ * changed meanwhile, and release them.
+ * Must be called with lock held.
+ */
+static void scull_cache_unpin_batch(struct scull_dev *dev,
+				    struct scull_cache_cursor *cur, int nr,
+				    bool written)
+{
+	struct scull_cache *cache = dev->cache;
+
+	for (int i = 0; i < nr; i++) {
+		struct scull_cache_slot *slot = &cache->slots[i];
+
+		/* qset nodes are only freed by trims */
+		if (written && cur->trim_gen == dev->trim_gen &&
+		    slot->dptr->data &&
+		    slot->dptr->data[slot->s_pos] == slot->data &&
+		    slot->dptr->gen[slot->s_pos] == slot->gen &&
+		    __test_and_clear_bit(slot->s_pos, slot->dptr->dirty)) {
+			cache->nr_dirty--;
+		}
+		scull_cache_unpin(dev, slot->data);
+	}
+
+	cache->wb_start = cache->wb_end = 0;
+	wake_up_all(&cache->wb_wait);
+}
+
+/*
+ * Write back the next run of dirty quanta of a pass, without the lock.
+ * Must be called with wb_lock held.
+ * Returns 1 if a batch was written, 0 if the pass is over, or a negative
+ * error.
+ */
+static int scull_cache_write_batch(struct scull_dev *dev,
+				   struct scull_cache_cursor *cur)
+{
+	struct scull_cache *cache = dev->cache;
+	struct iov_iter iter;
+	size_t len;
+
+	scull_lock(dev);
+	int nr = scull_cache_pin_batch(dev, cur, &len);
+	loff_t wpos = cache->wb_start;
+	scull_unlock(dev);
+
+	if (!nr) {
+		return 0;
+	}
+
+	iov_iter_kvec(&iter, ITER_SOURCE, cache->vecs, nr, len);
+	ssize_t ret = vfs_iter_write(cache->file, &iter, &wpos, 0);
+	if (ret >= 0 && ret < len) {
+		ret = -EIO;
+	}
+
+	scull_lock(dev);
+	scull_cache_unpin_batch(dev, cur, nr, ret >= 0);
+	scull_unlock(dev);
+
+	return ret < 0 ? ret : 1;
+}
+
+/*
+ * Write back all dirty quanta in one pass over the device.
+ */
+static int scull_cache_writeback(struct scull_dev *dev)
+{
+	struct scull_cache *cache = dev->cache;
+	struct scull_cache_cursor cur = { 0 };
+	int ret;
+
+	mutex_lock(&cache->wb_lock);
+
+	scull_lock(dev);
+	cur.dptr = dev->data;
+	cur.trim_gen = dev->trim_gen;
+	scull_unlock(dev);
+
+	do {
+		ret = scull_cache_write_batch(dev, &cur);
+		cond_resched();
+	} while (ret > 0);
+
+	mutex_unlock(&cache->wb_lock);
+
+	if (ret < 0) {
+		scull_lock(dev);
+		cache->err = ret;
+		scull_unlock(dev);
+		pr_warn("scull%d: write back failed: %d\n",
+			MINOR(dev->cdev.dev), ret);
+	}
+
+	return ret;
+}
+
+static void scull_cache_work(struct work_struct *work)
+{
+	struct scull_cache *cache =
+		container_of(to_delayed_work(work), struct scull_cache, work);
+
+	scull_cache_writeback(cache->dev);
+}
+
+/*
+ * Evict clean quanta from (dptr, s_pos) up to (stop, stop_pos), or up to
+ * the end of the device if stop is NULL, until a new quantum can be faulted
+ * in. The hand is left after the last evicted quantum. Returns true if
+ * enough quanta were evicted.
+ */
+static bool scull_cache_evict_range(struct scull_dev *dev,
+				    struct scull_qset *dptr, int s_pos,
+				    struct scull_qset *stop, int stop_pos)
+{
+	struct scull_cache *cache = dev->cache;
+
+	for (; dptr; dptr = dptr->next, s_pos = 0) {
+		int last = dptr == stop ? stop_pos : dev->qset;
+
+		for (int i = s_pos; dptr->data && i < last; i++) {
+			if (!dptr->data[i] || test_bit(i, dptr->dirty)) {
+				continue;
+			}
+			scull_free_quantum(dev, dptr, i);
+			cache->evict_dptr = dptr;
+			cache->evict_s_pos = i + 1;
+			if (--cache->nr_resident < scull_cache_quanta) {
+				return true;
+			}
+		}
+		if (dptr == stop) {
+			break;
+		}
+	}
+
+	return false;
+}
+
+static bool scull_cache_evict(struct scull_dev *dev)
+{
+	struct scull_cache *cache = dev->cache;
+
+	if (cache->evict_trim_gen != dev->trim_gen) {
+		cache->evict_dptr = dev->data;
+		cache->evict_s_pos = 0;
+		cache->evict_trim_gen = dev->trim_gen;
+	}
+
+	struct scull_qset *hand = cache->evict_dptr;
+	int hand_pos = cache->evict_s_pos;
+
+	return scull_cache_evict_range(dev, hand, hand_pos, NULL, 0) ||
+	       scull_cache_evict_range(dev, dev->data, 0, hand, hand_pos);
+}
+
+/*
+ * Make room for a new quantum.
+ * If all resident quanta are dirty, the write back is started and the
+ * limit is exceeded until it catches up.
+ */
+static void scull_cache_reclaim(struct scull_dev *dev)
+{
+	if (!scull_cache_evict(dev)) {
+		mod_delayed_work(system_unbound_wq, &dev->cache->work, 0);
+	}
+}
+
+/*
+ * Read the quantum at pos from the backing file.
+ * Must be called with lock held.
+ */
+int scull_cache_fault(struct scull_dev *dev, struct scull_qset *dptr, int s_pos,
+		      loff_t pos)
+{
+	struct scull_cache *cache = dev->cache;
+
+	if (scull_cache_quanta && cache->nr_resident >= scull_cache_quanta) {
+		scull_cache_reclaim(dev);
+	}
+
+	void *data = scull_alloc_data(dev, &dptr->data[s_pos]);
+	if (!data) {
+		return -ENOMEM;
+	}
+
+	ssize_t ret = kernel_read(cache->file, data, dev->quantum, &pos);
+	if (ret < 0) {
+		scull_free_data(dev, data);
+		return ret;
+	}
+
+	dptr->data[s_pos] = data;
+	cache->nr_resident++;
+
+	return 0;
+}
+
+/*
+ * Mark a quantum dirty and schedule its write back.
+ * Must be called with lock held.
+ */
+void scull_cache_dirty(struct scull_dev *dev, struct scull_qset *dptr,
+		       int s_pos)
+{
+	struct scull_cache *cache = dev->cache;
+
+	if (!__test_and_set_bit(s_pos, dptr->dirty)) {
+		cache->nr_dirty++;
+	}
+	queue_delayed_work(system_unbound_wq, &cache->work,
+			   msecs_to_jiffies(scull_writeback_ms));
+}
+
+/*
+ * Punch a hole in the backing file over [pos, pos + len). Fails with -EBUSY
+ * over the batch in flight, which could land after the hole.
+ * Must be called with lock held.
+ */
+int scull_cache_discard(struct scull_dev *dev, loff_t pos, loff_t len)
+{
+	struct scull_cache *cache = dev->cache;
+	int mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+
+	if (pos < cache->wb_end && cache->wb_start < pos + len) {
+		return -EBUSY;
+	}
+	return vfs_fallocate(cache->file, mode, pos, len);
+}
+
+/*
+ * Drop a resident quantum whose range of the backing file was discarded,
+ * without writing it back.
+ * Must be called with lock held.
+ */
+void scull_cache_drop(struct scull_dev *dev, struct scull_qset *dptr,
+		      int s_pos)
+{
+	struct scull_cache *cache = dev->cache;
+
+	if (__test_and_clear_bit(s_pos, dptr->dirty)) {
+		cache->nr_dirty--;
+	}
+	scull_free_quantum(dev, dptr, s_pos);
+	cache->nr_resident--;
+}
+
+/*
+ * Truncate the backing file as the device is trimmed, once the batch in
+ * flight is written. The lock is dropped while waiting for it.
+ * Must be called with lock held.
+ */
+void scull_cache_trim(struct scull_dev *dev)
+{
+	struct scull_cache *cache = dev->cache;
+
+	while (cache->wb_end) {
+		scull_unlock(dev);
+		wait_event(cache->wb_wait, !READ_ONCE(cache->wb_end));
+		scull_lock(dev);
+	}
+
+	cache->nr_resident = 0;
+	cache->nr_dirty = 0;
+
+	int err = vfs_truncate(&cache->file->f_path, 0);
+	if (err) {
+		pr_warn("scull%d: cannot truncate backing file: %d\n",
+			MINOR(dev->cdev.dev), err);
+	}
+}
+
+int scull_cache_fsync(struct scull_dev *dev, int datasync)
+{
+	struct scull_cache *cache = dev->cache;
+
+	int err = scull_cache_writeback(dev);
+	if (err) {
+		return err;
+	}
+
+	scull_lock(dev);
+	err = cache->err;
+	cache->err = 0;
+	scull_unlock(dev);
+	if (err) {
+		return err;
+	}
+
+	return vfs_fsync(cache->file, datasync);
+}
+
+/*
+ * Open the backing file of the device, if one is given.
+ */
+int scull_cache_init(struct scull_dev *dev, int index)
+{
+	if (index >= ARRAY_SIZE(scull_backing) || !scull_backing[index]) {
+		return 0;
+	}
+
+	if (scull_writeback_batch < 1) {
+		scull_writeback_batch = 1;
+	}
+	/* quanta are pinned by their pages while written back */
+	if (!PAGE_ALIGNED(scull_quantum)) {
+		pr_err("scull%d: cache mode needs quanta of whole pages\n",
+		       index);
+		return -EINVAL;
+	}
+
+	struct scull_cache *cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+	if (!cache) {
+		return -ENOMEM;
+	}
+
+	int err = -ENOMEM;
+
+	cache->vecs = kmalloc_array(scull_writeback_batch, sizeof(struct kvec),
+				    GFP_KERNEL);
+	cache->slots = kmalloc_array(scull_writeback_batch,
+				     sizeof(struct scull_cache_slot),
+				     GFP_KERNEL);
+	if (!cache->vecs || !cache->slots) {
+		goto fail;
+	}
+
+	cache->file = filp_open(scull_backing[index],
+				O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+	if (IS_ERR(cache->file)) {
+		err = PTR_ERR(cache->file);
+		pr_err("scull%d: cannot open %s: %d\n", index,
+		       scull_backing[index], err);
+		goto fail;
+	}
+	if (!S_ISREG(file_inode(cache->file)->i_mode)) {
+		err = -EINVAL;
+		filp_close(cache->file, NULL);
+		goto fail;
+	}
+
+	cache->dev = dev;
+	INIT_DELAYED_WORK(&cache->work, scull_cache_work);
+	mutex_init(&cache->wb_lock);
+	init_waitqueue_head(&cache->wb_wait);
+
+	dev->cache = cache;
+	dev->size = i_size_read(file_inode(cache->file));
+
+	return 0;
+
+fail:
+	kfree(cache->slots);
+	kfree(cache->vecs);
+	kfree(cache);
+	return err;
+}
+
+/*
+ * Write back everything and close the backing file.
+ * The device is in memory only afterwards.
+ */
+void scull_cache_cleanup(struct scull_dev *dev)
+{
+	struct scull_cache *cache = dev->cache;
+
+	if (!cache) {
+		return;
+	}
+
+	cancel_delayed_work_sync(&cache->work);
+	if (!scull_cache_writeback(dev)) {
+		vfs_fsync(cache->file, 0);
+	}
+	filp_close(cache->file, NULL);
+
+	dev->cache = NULL;
+	kfree(cache->slots);
+	kfree(cache->vecs);
+	kfree(cache);
+}
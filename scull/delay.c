@@ -0,0 +1,131 @@
+#include <linux/debugfs.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/random.h>
+#include <linux/sched.h>
+
+#include "scull.h"
+
+/*
+ * Latency and bandwidth injection, to emulate a slower device.
+ *
+ * Each completed read or write is delayed by a latency, made of a fixed part
+ * and a random part following the distribution given by latency_dist:
+ *   0: fixed, the random part is ignored
+ *   1: uniform in [0, latency_jitter_us]
+ *   2: exponential of mean latency_jitter_us
+ * When a bandwidth is set, transfers of each direction are serialized on an
+ * emulated channel, and also wait for their turn on it.
+ *
+ * The delay is spent after the lock is released, sleeping on an hrtimer.
+ */
+
+enum {
+	SCULL_DELAY_FIXED,
+	SCULL_DELAY_UNIFORM,
+	SCULL_DELAY_EXPONENTIAL,
+};
+
+/*
+ * Draw from an exponential distribution of the given mean, by inverting its
+ * CDF: -mean * ln(u), with u uniform in (0, 1].
+ * ln(u) = log2(u) * ln(2) is computed in 16.16 fixed point, log2 being
+ * interpolated linearly between powers of two.
+ */
+static u64 scull_delay_exponential(u64 mean)
+{
+	u32 u = get_random_u32() | 1;
+	int k = ilog2(u);
+	/* -log2(u / 2^32) in 16.16 */
+	u64 log2 = ((u64)(32 - k) << 16) -
+		   (((u64)(u - (1u << k)) << 16) >> k);
+
+	/* ln(2) is 45426 in 16.16 */
+	return (mean * ((log2 * 45426) >> 16)) >> 16;
+}
+
+static u64 scull_delay_latency(struct scull_delay *delay, bool write)
+{
+	u32 lat_us = write ? READ_ONCE(delay->write_lat_us) :
+			     READ_ONCE(delay->read_lat_us);
+	u64 lat = (u64)lat_us * NSEC_PER_USEC;
+	u64 jitter = (u64)READ_ONCE(delay->jitter_us) * NSEC_PER_USEC;
+
+	if (!jitter) {
+		return lat;
+	}
+
+	switch (READ_ONCE(delay->dist)) {
+	case SCULL_DELAY_UNIFORM:
+		return lat + mul_u64_u32_shr(jitter + 1, get_random_u32(), 32);
+	case SCULL_DELAY_EXPONENTIAL:
+		return lat + scull_delay_exponential(jitter);
+	default:
+		return lat;
+	}
+}
+
+/*
+ * Sleep until deadline, in ns of the monotonic clock.
+ * Returns early if a signal is pending.
+ */
+void scull_delay_until(u64 deadline)
+{
+	ktime_t expires = ns_to_ktime(deadline);
+
+	set_current_state(TASK_INTERRUPTIBLE);
+	schedule_hrtimeout(&expires, HRTIMER_MODE_ABS);
+}
+
+/*
+ * Delay the completion of a transfer of count bytes.
+ * Must be called without the lock held.
+ */
+void scull_delay_io(struct scull_dev *dev, bool write, size_t count)
+{
+	struct scull_delay *delay = &dev->delay;
+	u64 bw = write ? READ_ONCE(delay->write_bw) : READ_ONCE(delay->read_bw);
+	u64 lat = scull_delay_latency(delay, write);
+
+	if (!lat && !bw) {
+		return;
+	}
+
+	u64 now = ktime_get_ns();
+	u64 deadline = now + lat;
+
+	if (bw) {
+		/* reserve the next slot of the emulated channel */
+		u64 *next = &delay->bw_next[write];
+		u64 xfer = div64_u64((u64)count * NSEC_PER_SEC, bw);
+
+		spin_lock(&delay->lock);
+		u64 start = max(*next, now);
+		*next = start + xfer;
+		spin_unlock(&delay->lock);
+
+		deadline = max(deadline, start + xfer);
+	}
+
+	scull_delay_until(deadline);
+}
+
+void scull_delay_init(struct scull_dev *dev)
+{
+	struct scull_delay *delay = &dev->delay;
+
+	spin_lock_init(&delay->lock);
+
+	debugfs_create_u32("read_latency_us", 0644, dev->debugfs,
+			   &delay->read_lat_us);
+	debugfs_create_u32("write_latency_us", 0644, dev->debugfs,
+			   &delay->write_lat_us);
+	debugfs_create_u32("latency_jitter_us", 0644, dev->debugfs,
+			   &delay->jitter_us);
+	debugfs_create_u32("latency_dist", 0644, dev->debugfs, &delay->dist);
+	debugfs_create_u64("read_bandwidth", 0644, dev->debugfs,
+			   &delay->read_bw);
+	debugfs_create_u64("write_bandwidth", 0644, dev->debugfs,
+			   &delay->write_bw);
+}
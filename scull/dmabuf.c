@@ -0,0 +1,325 @@
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/fcntl.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/scatterlist.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include "scull.h"
+
+MODULE_IMPORT_NS(DMA_BUF);
+
+/*
+ * Export of device ranges as dma-bufs, for SCULL_IOCEXPORT.
+ * A dma-buf holds a reference to each page of the range, taken under
+ * dev->lock, and drops them when its last user goes away. It never looks
+ * at the device again, so it outlives trims, and it pins the module.
+ * CPU access syncs the mappings of the attached devices.
+ * A dma-buf covers at most scull_export_max bytes, which bounds the pages
+ * a single ioctl pins.
+ */
+
+static unsigned long scull_export_max = 256UL << 20; /* Bytes per dma-buf */
+
+module_param(scull_export_max, ulong, 0644);
+
+struct scull_dmabuf {
+	struct page **pages;
+	pgoff_t nr_pages;
+	struct mutex lock; /* Protects attachments */
+	struct list_head attachments;
+};
+
+struct scull_dmabuf_attachment {
+	struct list_head node;
+	struct device *dev;
+	struct sg_table *sgt; /* NULL while not mapped */
+	enum dma_data_direction dir;
+};
+
+static int scull_dmabuf_attach(struct dma_buf *dmabuf,
+			       struct dma_buf_attachment *attach)
+{
+	struct scull_dmabuf *buf = dmabuf->priv;
+	struct scull_dmabuf_attachment *a = kzalloc(sizeof(*a), GFP_KERNEL);
+
+	if (!a) {
+		return -ENOMEM;
+	}
+	a->dev = attach->dev;
+	attach->priv = a;
+
+	mutex_lock(&buf->lock);
+	list_add(&a->node, &buf->attachments);
+	mutex_unlock(&buf->lock);
+
+	return 0;
+}
+
+static void scull_dmabuf_detach(struct dma_buf *dmabuf,
+				struct dma_buf_attachment *attach)
+{
+	struct scull_dmabuf *buf = dmabuf->priv;
+	struct scull_dmabuf_attachment *a = attach->priv;
+
+	mutex_lock(&buf->lock);
+	list_del(&a->node);
+	mutex_unlock(&buf->lock);
+
+	kfree(a);
+}
+
+static struct sg_table *scull_dmabuf_map(struct dma_buf_attachment *attach,
+					 enum dma_data_direction dir)
+{
+	struct scull_dmabuf *buf = attach->dmabuf->priv;
+	struct scull_dmabuf_attachment *a = attach->priv;
+	struct sg_table *sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	int err;
+
+	if (!sgt) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	err = sg_alloc_table_from_pages(sgt, buf->pages, buf->nr_pages, 0,
+					buf->nr_pages << PAGE_SHIFT,
+					GFP_KERNEL);
+	if (err) {
+		goto fail;
+	}
+	err = dma_map_sgtable(attach->dev, sgt, dir, 0);
+	if (err) {
+		sg_free_table(sgt);
+		goto fail;
+	}
+
+	mutex_lock(&buf->lock);
+	a->sgt = sgt;
+	a->dir = dir;
+	mutex_unlock(&buf->lock);
+
+	return sgt;
+
+fail:
+	kfree(sgt);
+	return ERR_PTR(err);
+}
+
+static void scull_dmabuf_unmap(struct dma_buf_attachment *attach,
+			       struct sg_table *sgt,
+			       enum dma_data_direction dir)
+{
+	struct scull_dmabuf *buf = attach->dmabuf->priv;
+	struct scull_dmabuf_attachment *a = attach->priv;
+
+	mutex_lock(&buf->lock);
+	a->sgt = NULL;
+	mutex_unlock(&buf->lock);
+
+	dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static int scull_dmabuf_begin_cpu_access(struct dma_buf *dmabuf,
+					 enum dma_data_direction dir)
+{
+	struct scull_dmabuf *buf = dmabuf->priv;
+	struct scull_dmabuf_attachment *a;
+
+	mutex_lock(&buf->lock);
+	list_for_each_entry(a, &buf->attachments, node) {
+		if (a->sgt) {
+			dma_sync_sgtable_for_cpu(a->dev, a->sgt, a->dir);
+		}
+	}
+	mutex_unlock(&buf->lock);
+
+	return 0;
+}
+
+static int scull_dmabuf_end_cpu_access(struct dma_buf *dmabuf,
+				       enum dma_data_direction dir)
+{
+	struct scull_dmabuf *buf = dmabuf->priv;
+	struct scull_dmabuf_attachment *a;
+
+	mutex_lock(&buf->lock);
+	list_for_each_entry(a, &buf->attachments, node) {
+		if (a->sgt) {
+			dma_sync_sgtable_for_device(a->dev, a->sgt, a->dir);
+		}
+	}
+	mutex_unlock(&buf->lock);
+
+	return 0;
+}
+
+static int scull_dmabuf_mmap(struct dma_buf *dmabuf,
+			     struct vm_area_struct *vma)
+{
+	struct scull_dmabuf *buf = dmabuf->priv;
+
+	return vm_map_pages(vma, buf->pages, buf->nr_pages);
+}
+
+static int scull_dmabuf_vmap(struct dma_buf *dmabuf, struct iosys_map *map)
+{
+	struct scull_dmabuf *buf = dmabuf->priv;
+	void *vaddr = vm_map_ram(buf->pages, buf->nr_pages, NUMA_NO_NODE);
+
+	if (!vaddr) {
+		return -ENOMEM;
+	}
+	iosys_map_set_vaddr(map, vaddr);
+
+	return 0;
+}
+
+static void scull_dmabuf_vunmap(struct dma_buf *dmabuf, struct iosys_map *map)
+{
+	struct scull_dmabuf *buf = dmabuf->priv;
+
+	vm_unmap_ram(map->vaddr, buf->nr_pages);
+}
+
+static void scull_dmabuf_free(struct scull_dmabuf *buf, pgoff_t nr_pages)
+{
+	for (pgoff_t i = 0; i < nr_pages; i++) {
+		put_page(buf->pages[i]);
+	}
+	kvfree(buf->pages);
+	kfree(buf);
+}
+
+static void scull_dmabuf_release(struct dma_buf *dmabuf)
+{
+	struct scull_dmabuf *buf = dmabuf->priv;
+
+	scull_dmabuf_free(buf, buf->nr_pages);
+}
+
+static const struct dma_buf_ops scull_dmabuf_ops = {
+	.attach = scull_dmabuf_attach,
+	.detach = scull_dmabuf_detach,
+	.map_dma_buf = scull_dmabuf_map,
+	.unmap_dma_buf = scull_dmabuf_unmap,
+	.begin_cpu_access = scull_dmabuf_begin_cpu_access,
+	.end_cpu_access = scull_dmabuf_end_cpu_access,
+	.mmap = scull_dmabuf_mmap,
+	.vmap = scull_dmabuf_vmap,
+	.vunmap = scull_dmabuf_vunmap,
+	.release = scull_dmabuf_release,
+};
+
+/*
+ * Take a reference to each page of the range, allocating holes and
+ * extending a writable device over the range.
+ * Returns the number of pages taken, which is short on error.
+ * Must be called with lock held.
+ */
+static pgoff_t scull_dmabuf_get_pages(struct scull_dev *dev,
+				      struct scull_dmabuf *buf, loff_t offset,
+				      bool writable, int *err)
+{
+	loff_t end = offset + ((loff_t)buf->nr_pages << PAGE_SHIFT);
+	pgoff_t i;
+
+	if (dev->cache || !PAGE_ALIGNED(dev->quantum)) {
+		*err = -EOPNOTSUPP;
+		return 0;
+	}
+	if (!writable && end > dev->size) {
+		*err = -EINVAL;
+		return 0;
+	}
+
+	*err = scull_alloc_range(dev, offset, end - offset);
+	if (*err) {
+		return 0;
+	}
+
+	for (i = 0; i < buf->nr_pages; i++) {
+		loff_t pos = offset + ((loff_t)i << PAGE_SHIFT);
+		void *data = scull_quantum_at(dev, pos, false);
+
+		if (IS_ERR_OR_NULL(data)) {
+			*err = data ? PTR_ERR(data) : -ENOMEM;
+			break;
+		}
+		buf->pages[i] = virt_to_page(data + pos % dev->quantum);
+		get_page(buf->pages[i]);
+	}
+
+	if (!*err && dev->size < end) {
+		dev->size = end;
+	}
+	return i;
+}
+
+int scull_dmabuf_export(struct scull_dev *dev, const struct scull_export *exp,
+			bool writable)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(info);
+	int err;
+
+	if (!exp->length || !PAGE_ALIGNED(exp->offset) ||
+	    !PAGE_ALIGNED(exp->length) || exp->offset > MAX_LFS_FILESIZE ||
+	    exp->length > MAX_LFS_FILESIZE - exp->offset) {
+		return -EINVAL;
+	}
+	if (exp->flags & ~O_CLOEXEC) {
+		return -EINVAL;
+	}
+	/* checked again under the lock, before taking any page */
+	if (exp->length > READ_ONCE(scull_export_max) ||
+	    (!writable && exp->offset + exp->length > READ_ONCE(dev->size))) {
+		return -EINVAL;
+	}
+
+	struct scull_dmabuf *buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf) {
+		return -ENOMEM;
+	}
+	buf->nr_pages = exp->length >> PAGE_SHIFT;
+	buf->pages = kvmalloc_array(buf->nr_pages, sizeof(struct page *),
+				    GFP_KERNEL);
+	if (!buf->pages) {
+		kfree(buf);
+		return -ENOMEM;
+	}
+	mutex_init(&buf->lock);
+	INIT_LIST_HEAD(&buf->attachments);
+
+	if (scull_lock_interruptible(dev)) {
+		scull_dmabuf_free(buf, 0);
+		return -ERESTARTSYS;
+	}
+	pgoff_t got = scull_dmabuf_get_pages(dev, buf, exp->offset, writable,
+					     &err);
+	scull_unlock(dev);
+	if (err) {
+		scull_dmabuf_free(buf, got);
+		return err;
+	}
+
+	info.ops = &scull_dmabuf_ops;
+	info.size = exp->length;
+	info.flags = writable ? O_RDWR : O_RDONLY;
+	info.priv = buf;
+
+	struct dma_buf *dmabuf = dma_buf_export(&info);
+	if (IS_ERR(dmabuf)) {
+		scull_dmabuf_free(buf, got);
+		return PTR_ERR(dmabuf);
+	}
+
+	int fd = dma_buf_fd(dmabuf, exp->flags);
+	if (fd < 0) {
+		dma_buf_put(dmabuf); /* frees buf */
+	}
+	return fd;
+}
@@ -0,0 +1,725 @@
+#include <linux/err.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+
+#include "scull.h"
+#include "scull_trace.h"
+
+/*
+ * Storage engine: the data of a device is a list of qsets, each pointing to
+ * qset quanta of quantum bytes. Missing qsets and quanta are holes.
+ * It only uses the part of the kernel API emulated in uengine/, so that it
+ * also builds as a userspace library.
+ */
+
+int scull_quantum = SCULL_QUANTUM;
+int scull_qset = SCULL_QSET;
+
+module_param(scull_quantum, int, S_IRUGO);
+module_param(scull_qset, int, S_IRUGO);
+
+/* 
+* Trim the scull device to the minimum size. 
+* Must be called with lock held, which is dropped and taken again first in
+* cache mode while the write back in flight completes.
+*/
+int scull_trim(struct scull_dev *dev)
+{
+	struct scull_qset *dptr, *next;
+
+	/* first, as it may drop the lock to wait for the write back */
+	if (dev->cache) {
+		scull_cache_trim(dev);
+	}
+
+	int qset = dev->qset;
+
+	trace_scull_trim(MINOR(dev->cdev.dev), dev->size);
+
+	for (dptr = dev->data; dptr; dptr = next) {
+		if (dptr->data) {
+			for (int i = 0; i < qset; ++i) {
+				scull_free_data(dev, dptr->data[i]);
+			}
+			kfree(dptr->data);
+			dptr->data = NULL;
+		}
+		kfree(dptr->gen);
+		kfree(dptr->dirty);
+		next = dptr->next;
+		kfree(dptr);
+	}
+	dev->size = 0;
+	dev->trim_gen = ++dev->gen;
+	dev->quantum = scull_quantum;
+	dev->qset = scull_qset;
+	dev->data = NULL;
+	dev->hint = NULL;
+	memset(&dev->mem, 0, sizeof(dev->mem));
+	scull_heat_reset(dev);
+	scull_reserve_refill(dev);
+	sbull_trim(dev);
+
+	return 0;
+}
+
+static void *scull_alloc_done(struct scull_dev *dev, size_t size, void *p)
+{
+	trace_scull_alloc(MINOR(dev->cdev.dev), size, p);
+	if (p) {
+		scull_stat_inc(dev, allocs);
+	} else {
+		scull_stat_inc(dev, alloc_fails);
+	}
+	return p;
+}
+
+/*
+ * First attempt of the allocations that can fall back on the reserve: it
+ * only wakes kswapd, and fails rather than going into direct reclaim under
+ * dev->lock.
+ */
+#define SCULL_GFP_TRY (GFP_NOWAIT | __GFP_NOWARN)
+
+static void *__scull_alloc_data(struct scull_dev *dev, gfp_t gfp)
+{
+	size_t size = dev->quantum;
+
+	if (scull_movable(dev)) {
+		return scull_movable_alloc(gfp);
+	}
+	if (PAGE_ALIGNED(size)) {
+		return alloc_pages_exact(size, gfp | __GFP_ZERO);
+	}
+	return kzalloc(size, gfp);
+}
+
+/*
+ * Allocate the zeroed memory of a quantum, for slot to point to it.
+ * Quanta of whole pages come from the page allocator rather than the slab,
+ * so that their pages can be mapped and lent to dma-bufs, which hold
+ * references to them. Quanta of one page are movable, see movable.c.
+ * When memory is short, the quantum comes from the reserve of the device,
+ * and only once it is empty from an allocation that may reclaim.
+ * Must be called with lock held.
+ */
+void *scull_alloc_data(struct scull_dev *dev, void **slot)
+{
+	void *p = __scull_alloc_data(dev, SCULL_GFP_TRY);
+
+	if (!p) {
+		p = scull_reserve_quantum(dev);
+	}
+	if (!p) {
+		p = __scull_alloc_data(dev, GFP_KERNEL);
+	}
+	if (p && scull_movable(dev)) {
+		scull_movable_adopt(dev, p, slot);
+	}
+	return scull_alloc_done(dev, dev->quantum, p);
+}
+
+/*
+ * Free the memory of a quantum, or drop the reference of the device to
+ * its pages.
+ * Must be called with lock held.
+ */
+void scull_free_data(struct scull_dev *dev, void *data)
+{
+	if (!data) {
+		return;
+	}
+	if (scull_movable(dev)) {
+		scull_movable_free(data);
+	} else if (PAGE_ALIGNED(dev->quantum)) {
+		free_pages_exact(data, dev->quantum);
+	} else {
+		kfree(data);
+	}
+}
+
+/*
+ * Allocate a qset node or array, accounted as metadata, from the reserve
+ * of the device when memory is short, as for quanta.
+ * Must be called with lock held.
+ */
+static void *scull_zalloc_meta(struct scull_dev *dev, size_t size)
+{
+	void *p = kzalloc(size, SCULL_GFP_TRY);
+
+	if (!p) {
+		p = scull_reserve_meta(dev, size);
+	}
+	if (!p) {
+		p = kzalloc(size, GFP_KERNEL);
+	}
+	scull_alloc_done(dev, size, p);
+	if (p) {
+		dev->mem.meta_bytes += size;
+	}
+	return p;
+}
+
+/*
+ * Free the quantum at s_pos, which then reads as zeros.
+ * Must be called with lock held.
+ */
+void scull_free_quantum(struct scull_dev *dev, struct scull_qset *dptr,
+			int s_pos)
+{
+	scull_free_data(dev, dptr->data[s_pos]);
+	dptr->data[s_pos] = NULL;
+
+	dev->mem.quanta--;
+	dev->mem.data_bytes -= dev->quantum;
+	if (dptr->gen[s_pos]) {
+		dev->mem.written--;
+	}
+}
+
+/*
+ * Record that the quantum at s_pos was changed in generation gen.
+ * Must be called with lock held.
+ */
+static void scull_stamp(struct scull_dev *dev, struct scull_qset *dptr,
+			int s_pos, u64 gen)
+{
+	if (!dptr->gen[s_pos] && dptr->data[s_pos]) {
+		dev->mem.written++;
+	}
+	dptr->gen[s_pos] = gen;
+}
+
+/*
+ * Return the qset following dptr, allocating it if needed.
+ */
+static struct scull_qset *scull_next(struct scull_dev *dev,
+				     struct scull_qset *dptr)
+{
+	if (!dptr->next) {
+		dptr->next = scull_zalloc_meta(dev, sizeof(struct scull_qset));
+	}
+	return dptr->next;
+}
+
+/*
+ * Return the qset of item n, or NULL if the list is shorter.
+ * The walk starts from the last qset looked up when possible, which makes
+ * sequential accesses O(1).
+ */
+static struct scull_qset *scull_lookup(struct scull_dev *dev, int n)
+{
+	struct scull_qset *dptr = dev->data;
+	int i = 0;
+
+	if (dev->hint && dev->hint_item <= n) {
+		dptr = dev->hint;
+		i = dev->hint_item;
+	}
+	for (; dptr && i < n; i++) {
+		dptr = dptr->next;
+	}
+	if (dptr) {
+		dev->hint = dptr;
+		dev->hint_item = n;
+	}
+
+	return dptr;
+}
+
+/*
+ * Count the quanta with memory from the quantum of index first on.
+ * Must be called with lock held.
+ */
+u64 scull_quanta_from(struct scull_dev *dev, u64 first)
+{
+	int qset = dev->qset;
+	u64 q = first - first % qset;
+	u64 nr = 0;
+
+	if (q / qset > INT_MAX) {
+		return 0;
+	}
+	for (struct scull_qset *dptr = scull_lookup(dev, q / qset); dptr;
+	     dptr = dptr->next, q += qset) {
+		if (!dptr->data) {
+			continue;
+		}
+		for (int i = q < first ? first - q : 0; i < qset; i++) {
+			nr += !!dptr->data[i];
+		}
+	}
+
+	return nr;
+}
+
+struct scull_qset *scull_follow(struct scull_dev *dev, int n)
+{
+	struct scull_qset *dptr = dev->data;
+	int i = 0;
+
+	if (!dptr) {
+		dptr = dev->data =
+			scull_zalloc_meta(dev, sizeof(struct scull_qset));
+		if (!dptr) {
+			return NULL;
+		}
+	}
+
+	if (dev->hint && dev->hint_item <= n) {
+		dptr = dev->hint;
+		i = dev->hint_item;
+	}
+	int first = i;
+	for (; dptr && i < n; i++) {
+		dptr = scull_next(dev, dptr);
+	}
+	if (dptr) {
+		dev->hint = dptr;
+		dev->hint_item = n;
+	}
+	trace_scull_follow(MINOR(dev->cdev.dev), n, i - first, dptr != NULL);
+
+	return dptr;
+}
+
+/*
+ * Allocate the quantum array of a qset and its per quantum metadata.
+ * Must be called with lock held.
+ */
+static int scull_alloc_qset_data(struct scull_dev *dev, struct scull_qset *dptr)
+{
+	int qset = dev->qset;
+
+	if (!dptr->data) {
+		dptr->data = scull_zalloc_meta(dev, qset * sizeof(char *));
+		if (!dptr->data) {
+			return -ENOMEM;
+		}
+	}
+	if (!dptr->gen) {
+		dptr->gen = scull_zalloc_meta(dev, qset * sizeof(u64));
+		if (!dptr->gen) {
+			return -ENOMEM;
+		}
+	}
+	if (dev->cache && !dptr->dirty) {
+		dptr->dirty = scull_zalloc_meta(
+			dev, BITS_TO_LONGS(qset) * sizeof(unsigned long));
+		if (!dptr->dirty) {
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Allocate the quantum at s_pos, pos being its offset in the device.
+ * In cache mode, its content is read from the backing file.
+ * Must be called with lock held.
+ */
+static int scull_alloc_quantum(struct scull_dev *dev, struct scull_qset *dptr,
+			       int s_pos, loff_t pos)
+{
+	if (dev->cache) {
+		int err = scull_cache_fault(dev, dptr, s_pos, pos);
+		if (err) {
+			return err;
+		}
+	} else {
+		void **slot = &dptr->data[s_pos];
+
+		*slot = scull_alloc_data(dev, slot);
+		if (!*slot) {
+			return -ENOMEM;
+		}
+	}
+
+	dev->mem.quanta++;
+	dev->mem.data_bytes += dev->quantum;
+	if (dptr->gen[s_pos]) {
+		dev->mem.written++;
+	}
+	return 0;
+}
+
+/*
+ * Whether [pos, pos + len) can be addressed, items being ints.
+ */
+static bool scull_range_valid(struct scull_dev *dev, loff_t pos, size_t len)
+{
+	loff_t itemsize = (loff_t)dev->quantum * dev->qset;
+
+	return pos >= 0 && len <= LLONG_MAX - pos &&
+	       pos + len <= (loff_t)INT_MAX * itemsize;
+}
+
+/*
+ * Copy the device data at pos to iter. Holes read as zeros.
+ * Returns the number of bytes copied, which is short at the end of the
+ * device, or a negative error if nothing could be copied.
+ * Must be called with lock held.
+ */
+ssize_t scull_copy_to_iter(struct scull_dev *dev, struct iov_iter *iter,
+			   loff_t pos)
+{
+	if (!scull_range_valid(dev, pos, 0)) {
+		return -EINVAL;
+	}
+	if (pos >= dev->size) {
+		return 0;
+	}
+
+	size_t count = min_t(size_t, iov_iter_count(iter), dev->size - pos);
+
+	int quantum = dev->quantum;
+	int qset = dev->qset;
+	int itemsize = quantum * qset;
+
+	int item = (long)pos / itemsize;
+	int rest = (long)pos % itemsize;
+	int s_pos = rest / quantum;
+	int q_pos = rest % quantum;
+
+	struct scull_qset *dptr = scull_lookup(dev, item);
+	ssize_t done = 0;
+	int err = 0;
+
+	while (done < count) {
+		size_t chunk = min_t(size_t, count - done, quantum - q_pos);
+		void *data = dptr && dptr->data ? dptr->data[s_pos] : NULL;
+		size_t copied;
+
+		if (!data && dev->cache) {
+			/* fault in the quantum from the backing file */
+			if (!dptr) {
+				dptr = scull_follow(dev, item);
+			}
+			if (!dptr) {
+				err = -ENOMEM;
+				break;
+			}
+			err = scull_alloc_qset_data(dev, dptr);
+			if (!err) {
+				err = scull_alloc_quantum(dev, dptr, s_pos,
+							  pos - q_pos);
+			}
+			if (err) {
+				break;
+			}
+			data = dptr->data[s_pos];
+		}
+
+		if (data) {
+			copied = copy_to_iter(data + q_pos, chunk, iter);
+		} else {
+			copied = iov_iter_zero(chunk, iter);
+		}
+		done += copied;
+		pos += copied;
+		if (copied < chunk) {
+			err = -EFAULT;
+			break;
+		}
+
+		q_pos = 0;
+		if (++s_pos == qset) {
+			s_pos = 0;
+			item++;
+			dptr = dptr ? dptr->next : NULL;
+		}
+	}
+
+	scull_heat_record(dev, false, pos - done, done);
+	scull_stat_inc(dev, reads);
+	scull_stat_add(dev, read_bytes, done);
+
+	return done ? done : err;
+}
+
+/*
+ * Copy iter to the device at pos, allocating quanta as needed.
+ * With nocache, the copy uses non-temporal stores where the architecture
+ * has them, so that streaming data does not evict the CPU caches.
+ * Returns the number of bytes copied, or a negative error if nothing
+ * could be copied.
+ * Must be called with lock held.
+ */
+ssize_t __scull_copy_from_iter(struct scull_dev *dev, struct iov_iter *iter,
+			       loff_t pos, bool nocache)
+{
+	size_t count = iov_iter_count(iter);
+	if (!scull_range_valid(dev, pos, count)) {
+		return -EINVAL;
+	}
+	if (!count) {
+		return 0;
+	}
+	/* nothing is allocated for a write that cannot copy a byte */
+	if (fault_in_iov_iter_readable(iter, 1)) {
+		return -EFAULT;
+	}
+
+	int quantum = dev->quantum;
+	int qset = dev->qset;
+	int itemsize = quantum * qset;
+
+	int item = (long)pos / itemsize;
+	int rest = (long)pos % itemsize;
+	int s_pos = rest / quantum;
+	int q_pos = rest % quantum;
+
+	struct scull_qset *dptr = scull_follow(dev, item);
+	u64 gen = 0; /* new once a byte is stored */
+	ssize_t done = 0;
+	int err = 0;
+
+	while (done < count) {
+		if (!dptr) {
+			err = -ENOMEM;
+			break;
+		}
+		err = scull_alloc_qset_data(dev, dptr);
+		if (err) {
+			break;
+		}
+		if (!dptr->data[s_pos]) {
+			err = scull_alloc_quantum(dev, dptr, s_pos, pos - q_pos);
+			if (err) {
+				break;
+			}
+		}
+
+		size_t chunk = min_t(size_t, count - done, quantum - q_pos);
+		void *to = dptr->data[s_pos] + q_pos;
+		size_t copied;
+
+		if (nocache) {
+			copied = copy_from_iter_nocache(to, chunk, iter);
+		} else {
+			copied = copy_from_iter(to, chunk, iter);
+		}
+
+		if (copied) {
+			if (!gen) {
+				gen = ++dev->gen;
+			}
+			scull_stamp(dev, dptr, s_pos, gen);
+			if (dev->cache) {
+				scull_cache_dirty(dev, dptr, s_pos);
+			}
+		}
+		done += copied;
+		pos += copied;
+		if (copied < chunk) {
+			err = -EFAULT;
+			break;
+		}
+
+		q_pos = 0;
+		if (++s_pos == qset) {
+			s_pos = 0;
+			dptr = scull_next(dev, dptr);
+		}
+	}
+
+	/* a failed or empty write does not extend the device */
+	if (done && dev->size < pos) {
+		dev->size = pos;
+	}
+
+	scull_heat_record(dev, true, pos - done, done);
+	scull_stat_inc(dev, writes);
+	scull_stat_add(dev, write_bytes, done);
+
+	return done ? done : err;
+}
+
+/*
+ * Deallocate the range [pos, pos + len), which then reads as zeros.
+ * Fully covered quanta are freed and the others are zeroed in place.
+ * In cache mode, the range of the whole quanta is discarded from the
+ * backing file and their cached copies dropped. The other quanta are
+ * zeroed and written back, as is the whole range if the backing file
+ * cannot punch holes.
+ * Must be called with lock held.
+ */
+int scull_punch_hole(struct scull_dev *dev, loff_t pos, size_t len)
+{
+	if (!scull_range_valid(dev, pos, len)) {
+		return -EINVAL;
+	}
+
+	loff_t end = pos + len;
+
+	int quantum = dev->quantum;
+	int qset = dev->qset;
+	int itemsize = quantum * qset;
+
+	int item = (long)pos / itemsize;
+	int rest = (long)pos % itemsize;
+	int s_pos = rest / quantum;
+	int q_pos = rest % quantum;
+
+	/* [d_start, d_end) are whole quanta discarded from the backing file */
+	loff_t d_start = 0, d_end = 0;
+
+	if (dev->cache) {
+		end = min_t(loff_t, end, dev->size);
+		d_start = q_pos ? pos - q_pos + quantum : pos;
+		d_end = end == dev->size ? end : end - (long)end % quantum;
+		if (d_start >= d_end ||
+		    scull_cache_discard(dev, d_start, d_end - d_start)) {
+			d_end = d_start;
+		}
+	}
+
+	struct scull_qset *dptr = scull_lookup(dev, item);
+	const u64 gen = ++dev->gen;
+
+	while (pos < end) {
+		size_t chunk = min_t(size_t, end - pos, quantum - q_pos);
+
+		if (pos >= d_start && pos + chunk <= d_end) {
+			if (dptr && dptr->data && dptr->data[s_pos]) {
+				scull_cache_drop(dev, dptr, s_pos);
+				scull_stamp(dev, dptr, s_pos, gen);
+			}
+		} else if (dev->cache) {
+			if (!dptr) {
+				dptr = scull_follow(dev, item);
+			}
+			if (!dptr) {
+				return -ENOMEM;
+			}
+			int err = scull_alloc_qset_data(dev, dptr);
+			if (!err && !dptr->data[s_pos]) {
+				err = scull_alloc_quantum(dev, dptr, s_pos,
+							  pos - q_pos);
+			}
+			if (err) {
+				return err;
+			}
+			memset(dptr->data[s_pos] + q_pos, 0, chunk);
+			scull_stamp(dev, dptr, s_pos, gen);
+			scull_cache_dirty(dev, dptr, s_pos);
+		} else if (dptr && dptr->data && dptr->data[s_pos]) {
+			if (chunk == quantum) {
+				scull_free_quantum(dev, dptr, s_pos);
+			} else {
+				memset(dptr->data[s_pos] + q_pos, 0, chunk);
+			}
+			scull_stamp(dev, dptr, s_pos, gen);
+		}
+
+		pos += chunk;
+		q_pos = 0;
+		if (++s_pos == qset) {
+			s_pos = 0;
+			item++;
+			dptr = dptr ? dptr->next : NULL;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Allocate all the quanta of [pos, pos + len), so that writing to the
+ * range does not allocate memory.
+ * Must be called with lock held.
+ */
+int scull_alloc_range(struct scull_dev *dev, loff_t pos, size_t len)
+{
+	if (!scull_range_valid(dev, pos, len)) {
+		return -EINVAL;
+	}
+
+	loff_t end = pos + len;
+
+	int quantum = dev->quantum;
+	int qset = dev->qset;
+	int itemsize = quantum * qset;
+
+	int item = (long)pos / itemsize;
+	int rest = (long)pos % itemsize;
+	int s_pos = rest / quantum;
+	int q_pos = rest % quantum;
+
+	struct scull_qset *dptr = scull_follow(dev, item);
+
+	for (pos -= q_pos; pos < end; pos += quantum) {
+		if (!dptr) {
+			return -ENOMEM;
+		}
+		int err = scull_alloc_qset_data(dev, dptr);
+		if (!err && !dptr->data[s_pos]) {
+			err = scull_alloc_quantum(dev, dptr, s_pos, pos);
+		}
+		if (err) {
+			return err;
+		}
+
+		if (++s_pos == qset) {
+			s_pos = 0;
+			dptr = scull_next(dev, dptr);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Return the quantum holding pos, for direct access.
+ * For writing, the quantum is allocated if needed and stamped as changed.
+ * For reading, a hole gives NULL, except in cache mode where the quantum is
+ * read from the backing file.
+ * Returns an ERR_PTR on allocation or read failure, or for an invalid pos.
+ * Must be called with lock held.
+ */
+void *scull_quantum_at(struct scull_dev *dev, loff_t pos, bool write)
+{
+	if (!scull_range_valid(dev, pos, 1)) {
+		return ERR_PTR(-EINVAL);
+	}
+
+	int quantum = dev->quantum;
+	int qset = dev->qset;
+	int itemsize = quantum * qset;
+
+	int item = (long)pos / itemsize;
+	int s_pos = ((long)pos % itemsize) / quantum;
+
+	struct scull_qset *dptr = scull_lookup(dev, item);
+	void *data = dptr && dptr->data ? dptr->data[s_pos] : NULL;
+
+	if (!data && (write || dev->cache)) {
+		if (!dptr) {
+			dptr = scull_follow(dev, item);
+		}
+		if (!dptr) {
+			return ERR_PTR(-ENOMEM);
+		}
+		int err = scull_alloc_qset_data(dev, dptr);
+		if (!err) {
+			err = scull_alloc_quantum(dev, dptr, s_pos,
+						  pos - pos % quantum);
+		}
+		if (err) {
+			return ERR_PTR(err);
+		}
+		data = dptr->data[s_pos];
+	}
+
+	if (write) {
+		scull_stamp(dev, dptr, s_pos, ++dev->gen);
+		if (dev->cache) {
+			scull_cache_dirty(dev, dptr, s_pos);
+		}
+	}
+
+	return data;
+}
@@ -0,0 +1,151 @@
+#include <linux/debugfs.h>
+#include <linux/jiffies.h>
+#include <linux/module.h>
+#include <linux/seq_file.h>
+
+#include "scull.h"
+
+/*
+ * Access heat map.
+ *
+ * The device is split in SCULL_HEAT_REGIONS regions of a power of two size,
+ * each with a count of the reads and writes touching it. The region size
+ * starts at SCULL_HEAT_MIN_SHIFT and doubles, merging regions pairwise, when
+ * an access lands past the last region, so that the memory used does not
+ * depend on the device size.
+ *
+ * One access in scull_heat_sample is counted. Counts are halved every
+ * scull_heat_halflife_ms, so that the map follows the current workload.
+ * The heat map is maintained under dev->lock and shown by the heat debugfs
+ * file.
+ */
+
+#define SCULL_HEAT_MIN_SHIFT PAGE_SHIFT
+
+static unsigned int scull_heat_sample = 1;
+static unsigned int scull_heat_halflife_ms = 10000; /* 0 for no decay */
+
+module_param(scull_heat_sample, uint, 0644);
+module_param(scull_heat_halflife_ms, uint, 0644);
+
+/*
+ * Halve the counts once per half-life elapsed since the last decay.
+ * Must be called with lock held.
+ */
+static void scull_heat_decay(struct scull_heat *heat)
+{
+	unsigned int halflife = READ_ONCE(scull_heat_halflife_ms);
+
+	if (!halflife) {
+		return;
+	}
+
+	unsigned long epoch = jiffies / msecs_to_jiffies(halflife);
+	unsigned long n = epoch - heat->epoch;
+
+	if (!n) {
+		return;
+	}
+	heat->epoch = epoch;
+
+	int shift = min(n, 32UL);
+	for (int i = 0; i < SCULL_HEAT_REGIONS; i++) {
+		heat->reads[i] = shift < 32 ? heat->reads[i] >> shift : 0;
+		heat->writes[i] = shift < 32 ? heat->writes[i] >> shift : 0;
+	}
+}
+
+/*
+ * Double the region size, merging the counts of adjacent regions.
+ * Must be called with lock held.
+ */
+static void scull_heat_grow(struct scull_heat *heat)
+{
+	for (int i = 0; i < SCULL_HEAT_REGIONS / 2; i++) {
+		heat->reads[i] = heat->reads[2 * i] +
+				 min(heat->reads[2 * i + 1],
+				     U32_MAX - heat->reads[2 * i]);
+		heat->writes[i] = heat->writes[2 * i] +
+				  min(heat->writes[2 * i + 1],
+				      U32_MAX - heat->writes[2 * i]);
+	}
+	for (int i = SCULL_HEAT_REGIONS / 2; i < SCULL_HEAT_REGIONS; i++) {
+		heat->reads[i] = 0;
+		heat->writes[i] = 0;
+	}
+	heat->shift++;
+}
+
+/*
+ * Count an access to [pos, pos + len).
+ * Must be called with lock held.
+ */
+void scull_heat_record(struct scull_dev *dev, bool write, loff_t pos,
+		       size_t len)
+{
+	struct scull_heat *heat = &dev->heat;
+	unsigned int sample = READ_ONCE(scull_heat_sample);
+
+	if (!len || !sample || ++heat->tick < sample) {
+		return;
+	}
+	heat->tick = 0;
+
+	scull_heat_decay(heat);
+
+	loff_t last = pos + len - 1;
+	while (last >> heat->shift >= SCULL_HEAT_REGIONS) {
+		scull_heat_grow(heat);
+	}
+
+	u32 *count = write ? heat->writes : heat->reads;
+	for (int i = pos >> heat->shift; i <= last >> heat->shift; i++) {
+		if (count[i] < U32_MAX) {
+			count[i]++;
+		}
+	}
+}
+
+/*
+ * Clear the heat map, when the device is trimmed.
+ * Must be called with lock held.
+ */
+void scull_heat_reset(struct scull_dev *dev)
+{
+	memset(&dev->heat, 0, sizeof(dev->heat));
+	dev->heat.shift = SCULL_HEAT_MIN_SHIFT;
+}
+
+static int scull_heat_show(struct seq_file *s, void *v)
+{
+	struct scull_dev *dev = s->private;
+	struct scull_heat *heat = &dev->heat;
+
+	if (scull_lock_interruptible(dev)) {
+		return -ERESTARTSYS;
+	}
+
+	scull_heat_decay(heat);
+
+	seq_printf(s, "region_size %llu\n", 1ull << heat->shift);
+	for (int i = 0; i < SCULL_HEAT_REGIONS; i++) {
+		if (heat->reads[i] || heat->writes[i]) {
+			seq_printf(s, "%llu %u %u\n", (u64)i << heat->shift,
+				   heat->reads[i], heat->writes[i]);
+		}
+	}
+
+	scull_unlock(dev);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(scull_heat);
+
+void scull_heat_init(struct scull_dev *dev)
+{
+	scull_heat_reset(dev);
+
+	debugfs_create_file("heat", 0444, dev->debugfs, dev,
+			    &scull_heat_fops);
+}
@@ -0,0 +1,141 @@
+#include <linux/debugfs.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+#include "scull.h"
+
+/*
+ * Latency histograms of read and write service time, of the wait for
+ * dev->lock and of trims.
+ * Durations are counted in log2 buckets, per CPU and without locking.
+ * The latency debugfs file shows the non empty buckets and the percentiles,
+ * as the upper bound of the bucket they fall in. Writing to it resets the
+ * histograms.
+ */
+
+static const char *const scull_lat_names[SCULL_LAT_NR] = {
+	[SCULL_LAT_READ] = "read",
+	[SCULL_LAT_WRITE] = "write",
+	[SCULL_LAT_LOCK] = "lock",
+	[SCULL_LAT_TRIM] = "trim",
+};
+
+void scull_latency_sum(struct scull_dev *dev, struct scull_latency *sum)
+{
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for_each_possible_cpu(cpu) {
+		struct scull_latency *lat = per_cpu_ptr(dev->lat, cpu);
+
+		for (int t = 0; t < SCULL_LAT_NR; t++) {
+			for (int b = 0; b < SCULL_LAT_BUCKETS; b++) {
+				sum->hist[t][b] += READ_ONCE(lat->hist[t][b]);
+			}
+		}
+	}
+}
+
+/*
+ * Upper bound of the bucket holding the given per mille percentile.
+ */
+static u64 scull_lat_percentile(const u64 *hist, u64 total, int permille)
+{
+	u64 rank = div_u64(total * permille + 999, 1000);
+	u64 seen = 0;
+
+	for (int b = 0; b < SCULL_LAT_BUCKETS; b++) {
+		seen += hist[b];
+		if (seen >= rank) {
+			return 1ull << b;
+		}
+	}
+	return U64_MAX;
+}
+
+static int scull_latency_show(struct seq_file *s, void *v)
+{
+	struct scull_latency *sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+
+	if (!sum) {
+		return -ENOMEM;
+	}
+	scull_latency_sum(s->private, sum);
+
+	for (int t = 0; t < SCULL_LAT_NR; t++) {
+		const u64 *hist = sum->hist[t];
+		u64 total = 0;
+
+		for (int b = 0; b < SCULL_LAT_BUCKETS; b++) {
+			total += hist[b];
+		}
+
+		seq_printf(s, "%s: count %llu", scull_lat_names[t], total);
+		if (total) {
+			seq_printf(s, " p50 <%lluns p99 <%lluns p999 <%lluns",
+				   scull_lat_percentile(hist, total, 500),
+				   scull_lat_percentile(hist, total, 990),
+				   scull_lat_percentile(hist, total, 999));
+		}
+		seq_putc(s, '\n');
+
+		for (int b = 0; b < SCULL_LAT_BUCKETS; b++) {
+			if (hist[b]) {
+				seq_printf(s, "  < %12llu ns: %llu\n", 1ull << b,
+					   hist[b]);
+			}
+		}
+	}
+
+	kfree(sum);
+	return 0;
+}
+
+static int scull_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, scull_latency_show, inode->i_private);
+}
+
+static ssize_t scull_latency_write(struct file *file, const char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	struct scull_dev *dev = file_inode(file)->i_private;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		memset(per_cpu_ptr(dev->lat, cpu), 0,
+		       sizeof(struct scull_latency));
+	}
+
+	return count;
+}
+
+static const struct file_operations scull_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = scull_latency_open,
+	.read = seq_read,
+	.write = scull_latency_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+int scull_latency_init(struct scull_dev *dev)
+{
+	dev->lat = alloc_percpu(struct scull_latency);
+	if (!dev->lat) {
+		return -ENOMEM;
+	}
+
+	debugfs_create_file("latency", 0644, dev->debugfs, dev,
+			    &scull_latency_fops);
+
+	return 0;
+}
+
+void scull_latency_cleanup(struct scull_dev *dev)
+{
+	free_percpu(dev->lat);
+	dev->lat = NULL;
+}
@@ -0,0 +1,242 @@
+#include <linux/debugfs.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+
+#include "scull.h"
+
+/*
+ * Layout of a device, as coalesced extents of quanta in the same state:
+ * "offset length state" per line, state being one of
+ *   hole       no memory, reads as zeros
+ *   allocated  in memory
+ *   dirty      in memory and not yet written back, in cache mode
+ *   shared     in memory, with pages also referenced outside the device,
+ *              as by a dma-buf export or a migration in progress
+ *   backed     not in memory, read from the backing file on access
+ * Extents are found while reading the file, taking dev->lock for at most
+ * SCULL_LAYOUT_STEP quanta at a time, so that the layout of a large device
+ * can be streamed without stalling its I/O.
+ */
+
+#define SCULL_LAYOUT_STEP 1024
+
+enum scull_layout_state {
+	SCULL_LAYOUT_HOLE,
+	SCULL_LAYOUT_ALLOCATED,
+	SCULL_LAYOUT_DIRTY,
+	SCULL_LAYOUT_BACKED,
+	SCULL_LAYOUT_SHARED,
+};
+
+static const char *const scull_layout_names[] = {
+	[SCULL_LAYOUT_HOLE] = "hole",
+	[SCULL_LAYOUT_ALLOCATED] = "allocated",
+	[SCULL_LAYOUT_DIRTY] = "dirty",
+	[SCULL_LAYOUT_BACKED] = "backed",
+	[SCULL_LAYOUT_SHARED] = "shared",
+};
+
+struct scull_layout_iter {
+	struct scull_dev *dev;
+	loff_t start; /* Current extent */
+	loff_t len;
+	int state;
+	long item; /* Cursor, valid while trim_gen is */
+	struct scull_qset *dptr; /* qset of item */
+	u64 trim_gen;
+};
+
+/*
+ * Whether a page of the quantum has references besides the one of the
+ * device. Only quanta of whole pages are lent out.
+ */
+static bool scull_layout_shared(struct scull_dev *dev, void *data)
+{
+	if (!PAGE_ALIGNED(dev->quantum)) {
+		return false;
+	}
+	for (int off = 0; off < dev->quantum; off += PAGE_SIZE) {
+		if (page_count(virt_to_page(data + off)) > 1) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static int scull_layout_state(struct scull_dev *dev, struct scull_qset *dptr,
+			      int s_pos)
+{
+	if (dptr && dptr->data && dptr->data[s_pos]) {
+		if (dptr->dirty && test_bit(s_pos, dptr->dirty)) {
+			return SCULL_LAYOUT_DIRTY;
+		}
+		if (scull_layout_shared(dev, dptr->data[s_pos])) {
+			return SCULL_LAYOUT_SHARED;
+		}
+		return SCULL_LAYOUT_ALLOCATED;
+	}
+	return dev->cache ? SCULL_LAYOUT_BACKED : SCULL_LAYOUT_HOLE;
+}
+
+/*
+ * Return the qset of item, walking from the cursor when possible.
+ * Must be called with lock held.
+ */
+static struct scull_qset *scull_layout_seek(struct scull_layout_iter *it,
+					    long item)
+{
+	struct scull_dev *dev = it->dev;
+	struct scull_qset *dptr = dev->data;
+	long i = 0;
+
+	if (it->dptr && it->trim_gen == dev->trim_gen && it->item <= item) {
+		dptr = it->dptr;
+		i = it->item;
+	}
+	for (; dptr && i < item; i++) {
+		dptr = dptr->next;
+	}
+
+	it->item = item;
+	it->dptr = dptr;
+	it->trim_gen = dev->trim_gen;
+	return dptr;
+}
+
+/*
+ * Find the extent starting at pos. Its length is 0 past the end of the
+ * device.
+ */
+static int scull_layout_extent(struct scull_layout_iter *it, loff_t pos)
+{
+	struct scull_dev *dev = it->dev;
+	loff_t end = pos;
+	bool done = false;
+
+	it->start = pos;
+	it->len = 0;
+	it->state = -1;
+
+	while (!done) {
+		if (scull_lock_interruptible(dev)) {
+			return -ERESTARTSYS;
+		}
+
+		int quantum = dev->quantum;
+		int qset = dev->qset;
+		long itemsize = (long)quantum * qset;
+
+		long item = (long)end / itemsize;
+		int s_pos = ((long)end % itemsize) / quantum;
+
+		struct scull_qset *dptr = scull_layout_seek(it, item);
+
+		for (int n = 0; n < SCULL_LAYOUT_STEP; n++) {
+			if (end >= dev->size) {
+				done = true;
+				break;
+			}
+
+			int state = scull_layout_state(dev, dptr, s_pos);
+			if (it->state < 0) {
+				it->state = state;
+			} else if (state != it->state) {
+				done = true;
+				break;
+			}
+
+			if (!dptr) {
+				/* past the list, up to the end is the same */
+				end = dev->size;
+				continue;
+			}
+			end = min_t(loff_t, end - end % quantum + quantum,
+				    dev->size);
+			if (++s_pos == qset) {
+				s_pos = 0;
+				dptr = dptr->next;
+				it->item++;
+				it->dptr = dptr;
+			}
+		}
+
+		scull_unlock(dev);
+		cond_resched();
+	}
+
+	it->len = end - pos;
+	return 0;
+}
+
+static void *scull_layout_start(struct seq_file *s, loff_t *pos)
+{
+	struct scull_layout_iter *it = s->private;
+
+	int err = scull_layout_extent(it, *pos);
+	if (err) {
+		return ERR_PTR(err);
+	}
+	return it->len ? it : NULL;
+}
+
+static void *scull_layout_next(struct seq_file *s, void *v, loff_t *pos)
+{
+	struct scull_layout_iter *it = v;
+
+	*pos = it->start + it->len;
+
+	int err = scull_layout_extent(it, *pos);
+	if (err) {
+		return ERR_PTR(err);
+	}
+	return it->len ? it : NULL;
+}
+
+static void scull_layout_stop(struct seq_file *s, void *v)
+{
+}
+
+static int scull_layout_show(struct seq_file *s, void *v)
+{
+	struct scull_layout_iter *it = v;
+
+	seq_printf(s, "%lld %lld %s\n", it->start, it->len,
+		   scull_layout_names[it->state]);
+
+	return 0;
+}
+
+static const struct seq_operations scull_layout_seq_ops = {
+	.start = scull_layout_start,
+	.next = scull_layout_next,
+	.stop = scull_layout_stop,
+	.show = scull_layout_show,
+};
+
+static int scull_layout_open(struct inode *inode, struct file *file)
+{
+	struct scull_layout_iter *it = __seq_open_private(
+		file, &scull_layout_seq_ops, sizeof(struct scull_layout_iter));
+
+	if (!it) {
+		return -ENOMEM;
+	}
+	it->dev = inode->i_private;
+	return 0;
+}
+
+static const struct file_operations scull_layout_fops = {
+	.owner = THIS_MODULE,
+	.open = scull_layout_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = seq_release_private,
+};
+
+void scull_layout_init(struct scull_dev *dev)
+{
+	debugfs_create_file("layout", 0444, dev->debugfs, dev,
+			    &scull_layout_fops);
+}
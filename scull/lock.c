@@ -0,0 +1,96 @@
+#include <linux/debugfs.h>
+#include <linux/module.h>
+#include <linux/seq_file.h>
+
+#include "scull.h"
+
+/*
+ * Contention and hold time of dev->lock.
+ * Acquisitions, contended acquisitions, wait and hold time are counted
+ * per CPU along with the other operation counters. The longest hold and the
+ * place the lock was taken for it are kept in the device, updated by the
+ * holder before it releases the lock.
+ * A hold longer than scull_lock_warn_us is reported in the kernel log.
+ */
+
+unsigned int scull_lock_warn_us = 0; /* 0 for no warning */
+module_param(scull_lock_warn_us, uint, 0644);
+
+/*
+ * Slow path of scull_unlock, for a hold that is the longest seen or over
+ * the warning threshold.
+ * Must be called with lock held.
+ */
+void scull_lock_held_long(struct scull_dev *dev, u64 held)
+{
+	struct scull_lockstat *ls = &dev->lockstat;
+	unsigned int warn_us = READ_ONCE(scull_lock_warn_us);
+
+	if (held > ls->max_hold_ns) {
+		WRITE_ONCE(ls->max_hold_ns, held);
+		WRITE_ONCE(ls->max_hold_ip, ls->ip);
+	}
+	if (warn_us && held > (u64)warn_us * NSEC_PER_USEC) {
+		pr_warn_ratelimited("scull%d: lock held %llu us, taken at %pS\n",
+				    MINOR(dev->cdev.dev),
+				    div_u64(held, NSEC_PER_USEC),
+				    (void *)ls->ip);
+	}
+}
+
+static int scull_lock_show(struct seq_file *s, void *v)
+{
+	struct scull_dev *dev = s->private;
+	struct scull_stats sum;
+
+	scull_stats_sum(dev, &sum);
+
+	seq_printf(s, "acquired %llu\n", sum.lock_acquired);
+	seq_printf(s, "contended %llu\n", sum.lock_contended);
+	seq_printf(s, "wait_ns %llu\n", sum.lock_wait_ns);
+	seq_printf(s, "hold_ns %llu\n", sum.lock_hold_ns);
+	seq_printf(s, "max_hold_ns %llu\n",
+		   READ_ONCE(dev->lockstat.max_hold_ns));
+	seq_printf(s, "max_hold_at %pS\n",
+		   (void *)READ_ONCE(dev->lockstat.max_hold_ip));
+
+	return 0;
+}
+
+static int scull_lock_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, scull_lock_show, inode->i_private);
+}
+
+/*
+ * Writing to the file resets the longest hold.
+ */
+static ssize_t scull_lock_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct scull_dev *dev = file_inode(file)->i_private;
+
+	/* not scull_lock, this hold would be recorded as the new maximum */
+	mutex_lock(&dev->lock);
+	dev->lockstat.max_hold_ns = 0;
+	dev->lockstat.max_hold_ip = 0;
+	mutex_unlock(&dev->lock);
+
+	return count;
+}
+
+static const struct file_operations scull_lock_fops = {
+	.owner = THIS_MODULE,
+	.open = scull_lock_open,
+	.read = seq_read,
+	.write = scull_lock_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+void scull_lock_init(struct scull_dev *dev)
+{
+	mutex_init(&dev->lock);
+
+	debugfs_create_file("lock", 0644, dev->debugfs, dev, &scull_lock_fops);
+}
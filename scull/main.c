@@ -0,0 +1,936 @@
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/cdev.h>
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <asm/uaccess.h>
+
+#include "scull.h"
+
+#define CREATE_TRACE_POINTS
+#include "scull_trace.h"
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_AUTHOR("Rémi THEBAULT");
+
+static int scull_major = SCULL_MAJOR;
+static int scull_minor = 0;
+static int scull_num_devs = SCULL_NUM_DEVS;
+
+module_param(scull_major, int, S_IRUGO);
+module_param(scull_minor, int, S_IRUGO);
+module_param(scull_num_devs, int, S_IRUGO);
+
+/* Smallest write copied with non-temporal stores on devices in stream mode */
+static unsigned int scull_stream_min = 64 * 1024;
+
+module_param(scull_stream_min, uint, 0644);
+
+static int scull_open(struct inode *inode, struct file *filp);
+static int scull_release(struct inode *inode, struct file *filp);
+static ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
+			  loff_t *f_pos);
+static ssize_t scull_write(struct file *filp, const char __user *buf,
+			   size_t count, loff_t *f_pos);
+static ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *iter);
+static ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *iter);
+static loff_t scull_llseek(struct file *filp, loff_t off, int whence);
+static int scull_fsync(struct file *filp, loff_t start, loff_t end,
+		       int datasync);
+static long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+
+static struct file_operations scull_fops = {
+	.owner = THIS_MODULE,
+	.open = scull_open,
+	.release = scull_release,
+	.read = scull_read,
+	.write = scull_write,
+	.read_iter = scull_read_iter,
+	.write_iter = scull_write_iter,
+	.llseek = scull_llseek,
+	.fsync = scull_fsync,
+	.unlocked_ioctl = scull_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+};
+
+static struct scull_dev *scull_devices = NULL;
+static struct dentry *scull_debugfs_root = NULL;
+
+/*
+ * Add the memory footprint of a device to info.
+ * Must be called with lock held.
+ */
+static void scull_mem_add(struct scull_dev *dev, struct scull_mem_info *info)
+{
+	u64 nr_quanta = DIV_ROUND_UP(dev->size, dev->quantum);
+	u64 past_size = scull_quanta_from(dev, nr_quanta);
+	int tail = dev->size % dev->quantum;
+
+	info->size += dev->size;
+	info->data_bytes += dev->mem.data_bytes;
+	info->meta_bytes += dev->mem.meta_bytes;
+	info->quanta += dev->mem.quanta;
+	info->written += dev->mem.written;
+	info->holes += nr_quanta - (dev->mem.quanta - past_size);
+	info->past_size += past_size;
+	if (tail) {
+		info->tail_waste += dev->quantum - tail;
+	}
+}
+
+#ifdef SCULL_DEBUG
+
+/*
+ * Cursor of /proc/scullseq.
+ * The dump goes one qset at a time and dev->lock is only held for a step,
+ * so that dumping a large device does not stall its I/O. Qset nodes are only
+ * freed by a trim, so the cursor stays valid as long as the trim generation
+ * of the device does not change. The dump of a device trimmed meanwhile is
+ * cut short.
+ */
+struct scull_proc_iter {
+	loff_t pos; /* Position of the cursor, -1 if not set */
+	int index; /* Device */
+	long item; /* -1 for the device header */
+	struct scull_qset *dptr; /* qset of item */
+	u64 trim_gen;
+};
+
+static loff_t scull_proc_pos(int index, long item)
+{
+	return ((loff_t)index << 32) | (item + 1);
+}
+
+/*
+ * Set the cursor at pos, walking the list of the device unless the cursor
+ * is already there. A position past the last qset of a device moves to the
+ * next device.
+ */
+static int scull_proc_seek(struct scull_proc_iter *it, loff_t pos)
+{
+	if (pos == it->pos) {
+		return 0;
+	}
+
+	it->index = pos >> 32;
+	it->item = (long)(pos & U32_MAX) - 1;
+	it->dptr = NULL;
+
+	if (it->index < scull_num_devs && it->item >= 0) {
+		struct scull_dev *dev = scull_devices + it->index;
+		struct scull_qset *dptr;
+
+		if (scull_lock_interruptible(dev)) {
+			it->pos = -1;
+			return -ERESTARTSYS;
+		}
+		dptr = dev->data;
+		for (long i = 0; dptr && i < it->item; i++) {
+			dptr = dptr->next;
+		}
+		it->trim_gen = dev->trim_gen;
+		scull_unlock(dev);
+
+		if (dptr) {
+			it->dptr = dptr;
+		} else {
+			it->index++;
+			it->item = -1;
+		}
+	}
+
+	it->pos = scull_proc_pos(it->index, it->item);
+	return 0;
+}
+
+static void *scull_proc_seqstart(struct seq_file *s, loff_t *pos)
+{
+	struct scull_proc_iter *it = s->private;
+
+	if (scull_proc_seek(it, *pos)) {
+		return ERR_PTR(-ERESTARTSYS);
+	}
+	*pos = it->pos;
+
+	return it->index < scull_num_devs ? it : NULL;
+}
+
+static void *scull_proc_seqnext(struct seq_file *s, void *v, loff_t *pos)
+{
+	struct scull_proc_iter *it = v;
+	struct scull_dev *dev = scull_devices + it->index;
+	struct scull_qset *dptr = NULL;
+
+	scull_lock(dev);
+	if (it->item < 0) {
+		dptr = dev->data;
+		it->trim_gen = dev->trim_gen;
+	} else if (it->trim_gen == dev->trim_gen) {
+		dptr = it->dptr->next;
+	}
+	scull_unlock(dev);
+
+	if (dptr) {
+		it->item++;
+	} else {
+		it->index++;
+		it->item = -1;
+	}
+	it->dptr = dptr;
+	it->pos = *pos = scull_proc_pos(it->index, it->item);
+
+	return it->index < scull_num_devs ? it : NULL;
+}
+
+static void scull_proc_seqstop(struct seq_file *s, void *v)
+{
+	// Nothing to do
+}
+
+static int scull_proc_devshow(struct seq_file *s, struct scull_dev *dev)
+{
+	if (scull_lock_interruptible(dev)) {
+		return -ERESTARTSYS;
+	}
+
+	seq_printf(s,
+		   "Scull Device %i: %llu quanta (qset=%i, quantum=%i), size = %li\n",
+		   (int)(dev - scull_devices), dev->mem.quanta, dev->qset,
+		   dev->quantum, dev->size);
+
+	scull_unlock(dev);
+
+	return 0;
+}
+
+static int scull_proc_seqshow(struct seq_file *s, void *v)
+{
+	struct scull_proc_iter *it = v;
+	struct scull_dev *dev = scull_devices + it->index;
+
+	if (it->item < 0) {
+		return scull_proc_devshow(s, dev);
+	}
+
+	if (scull_lock_interruptible(dev)) {
+		return -ERESTARTSYS;
+	}
+
+	if (it->trim_gen != dev->trim_gen) {
+		seq_puts(s, "  trimmed during the dump\n");
+	} else {
+		struct scull_qset *qs = it->dptr;
+		int quanta = 0;
+
+		for (int i = 0; qs->data && i < dev->qset; i++) {
+			quanta += qs->data[i] != NULL;
+		}
+		seq_printf(s, "  item %li at %p; qset at %p; %i quanta\n",
+			   it->item, qs, qs->data, quanta);
+	}
+
+	scull_unlock(dev);
+
+	return 0;
+}
+
+/*
+ * /proc/scullsingle only has the header of each device, it must fit in
+ * a single buffer.
+ */
+static int scull_proc_singleshow(struct seq_file *s, void *v)
+{
+	for (int i = 0; i < scull_num_devs; i++) {
+		const int err = scull_proc_devshow(s, scull_devices + i);
+		if (err) {
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+static void scull_proc_memshow_one(struct seq_file *s, const char *name,
+				   const struct scull_mem_info *info)
+{
+	seq_printf(s,
+		   "%s: size %llu data %llu meta %llu quanta %llu written %llu holes %llu tail_waste %llu\n",
+		   name, info->size, info->data_bytes, info->meta_bytes,
+		   info->quanta, info->written, info->holes, info->tail_waste);
+	seq_printf(s, "%s: past_size %llu\n", name, info->past_size);
+}
+
+static int scull_proc_memshow(struct seq_file *s, void *v)
+{
+	struct scull_mem_info total = { 0 };
+
+	for (int i = 0; i < scull_num_devs; i++) {
+		struct scull_dev *dev = scull_devices + i;
+		struct scull_mem_info info = { 0 };
+		char name[16];
+
+		if (scull_lock_interruptible(dev)) {
+			return -ERESTARTSYS;
+		}
+		scull_mem_add(dev, &info);
+		scull_mem_add(dev, &total);
+		scull_unlock(dev);
+
+		snprintf(name, sizeof(name), "scull%d", i);
+		scull_proc_memshow_one(s, name, &info);
+	}
+	scull_proc_memshow_one(s, "total", &total);
+
+	return 0;
+}
+
+static const struct seq_operations scull_proc_seq_ops = {
+	.start = scull_proc_seqstart,
+	.stop = scull_proc_seqstop,
+	.next = scull_proc_seqnext,
+	.show = scull_proc_seqshow,
+};
+
+static int scull_proc_singleopen(struct inode *inode, struct file *file)
+{
+	return single_open(file, scull_proc_singleshow, NULL);
+}
+
+static int scull_proc_memopen(struct inode *inode, struct file *file)
+{
+	return single_open(file, scull_proc_memshow, NULL);
+}
+
+static int scull_proc_seqopen(struct inode *inode, struct file *file)
+{
+	struct scull_proc_iter *it = __seq_open_private(
+		file, &scull_proc_seq_ops, sizeof(struct scull_proc_iter));
+
+	if (!it) {
+		return -ENOMEM;
+	}
+	it->pos = -1;
+	return 0;
+}
+
+static struct proc_ops scull_proc_ops_single = {
+	.proc_open = scull_proc_singleopen,
+	.proc_read = seq_read,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
+};
+
+static struct proc_ops scull_proc_ops_mem = {
+	.proc_open = scull_proc_memopen,
+	.proc_read = seq_read,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
+};
+
+static struct proc_ops scull_proc_ops_seq = {
+	.proc_open = scull_proc_seqopen,
+	.proc_read = seq_read,
+	.proc_lseek = seq_lseek,
+	.proc_release = seq_release_private,
+};
+
+static void scull_proc_create(void)
+{
+	proc_create("scullsingle", 0, NULL, &scull_proc_ops_single);
+	proc_create("scullseq", 0, NULL, &scull_proc_ops_seq);
+	proc_create("scullmem", 0, NULL, &scull_proc_ops_mem);
+}
+
+static void scull_proc_remove(void)
+{
+	remove_proc_entry("scullmem", NULL);
+	remove_proc_entry("scullseq", NULL);
+	remove_proc_entry("scullsingle", NULL);
+}
+
+#endif
+
+/*
+ * Device of the given index, for the kernel API.
+ * Devices live as long as the module, which the users of its symbols
+ * depend on.
+ */
+struct scull_dev *scull_get_device(int index)
+{
+	if (index < 0 || index >= scull_num_devs || !scull_devices) {
+		return ERR_PTR(-ENODEV);
+	}
+	return &scull_devices[index];
+}
+EXPORT_SYMBOL_GPL(scull_get_device);
+
+static int scull_open(struct inode *inode, struct file *filp)
+{
+	struct scull_dev *dev;
+
+	dev = container_of(inode->i_cdev, struct scull_dev, cdev);
+	filp->private_data = dev;
+	/* O_DIRECT asks for non-temporal copies */
+	filp->f_mode |= FMODE_CAN_ODIRECT;
+
+	if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
+		if (scull_lock_interruptible(dev)) {
+			return -ERESTARTSYS;
+		}
+		u64 start = ktime_get_ns();
+		scull_trim(dev);
+		scull_lat_record(dev, SCULL_LAT_TRIM, ktime_get_ns() - start);
+		scull_unlock(dev);
+		scull_stat_inc(dev, trims);
+	}
+
+	trace_scull_open(MINOR(dev->cdev.dev), filp, filp->f_flags);
+	return 0;
+}
+
+static int scull_release(struct inode *inode, struct file *filp)
+{
+	struct scull_dev *dev = filp->private_data;
+
+	trace_scull_release(MINOR(dev->cdev.dev), filp);
+	return 0;
+}
+
+/*
+ * Read from *f_pos to iter, through the QoS limits and I/O delays, cgid
+ * being the cgroup charged. Used by read(), and by the read_iter of
+ * synchronous and queued asynchronous requests.
+ */
+ssize_t scull_do_read(struct file *filp, struct iov_iter *iter, loff_t *f_pos,
+		      u64 cgid)
+{
+	struct scull_dev *dev = filp->private_data;
+	size_t requested = iov_iter_count(iter);
+	ssize_t retval;
+
+	/* do not charge what is past the end of the device */
+	loff_t size = READ_ONCE(dev->size);
+	size_t count = *f_pos < size ? min_t(size_t, requested, size - *f_pos) :
+				       0;
+	iov_iter_truncate(iter, count);
+
+	retval = scull_qos_charge(dev, cgid, count);
+	if (retval) {
+		return retval;
+	}
+
+	u64 start = ktime_get_ns();
+
+	if (scull_lock_interruptible(dev)) {
+		scull_qos_refund(dev, cgid, count, true);
+		return -ERESTARTSYS;
+	}
+
+	loff_t pos = *f_pos;
+
+	retval = scull_copy_to_iter(dev, iter, pos);
+	if (retval > 0) {
+		*f_pos += retval;
+	}
+
+	scull_unlock(dev);
+	u64 ns = ktime_get_ns() - start;
+	scull_lat_record(dev, SCULL_LAT_READ, ns);
+	trace_scull_read(MINOR(dev->cdev.dev), filp, pos, requested, retval,
+			 ns);
+
+	scull_qos_refund(dev, cgid, retval > 0 ? count - retval : count,
+			 retval < 0);
+
+	if (retval > 0) {
+		scull_delay_io(dev, false, retval);
+	}
+	return retval;
+}
+
+/*
+ * Whether a write bypasses the CPU caches: always for files open with
+ * O_DIRECT, and for large writes on devices in stream mode.
+ */
+static bool scull_stream(struct scull_dev *dev, struct file *filp,
+			 size_t count)
+{
+	return (filp->f_flags & O_DIRECT) ||
+	       (READ_ONCE(dev->stream) &&
+		count >= READ_ONCE(scull_stream_min));
+}
+
+/*
+ * Write iter at *f_pos, through the QoS limits and I/O delays, cgid being
+ * the cgroup charged.
+ */
+ssize_t scull_do_write(struct file *filp, struct iov_iter *iter,
+		       loff_t *f_pos, u64 cgid)
+{
+	struct scull_dev *dev = filp->private_data;
+	size_t count = iov_iter_count(iter);
+	ssize_t retval;
+
+	retval = scull_qos_charge(dev, cgid, count);
+	if (retval) {
+		return retval;
+	}
+
+	u64 start = ktime_get_ns();
+
+	if (scull_lock_interruptible(dev)) {
+		scull_qos_refund(dev, cgid, count, true);
+		return -ERESTARTSYS;
+	}
+
+	loff_t pos = *f_pos;
+
+	retval = __scull_copy_from_iter(dev, iter, pos,
+					scull_stream(dev, filp, count));
+	if (retval > 0) {
+		*f_pos += retval;
+	}
+
+	scull_unlock(dev);
+	u64 ns = ktime_get_ns() - start;
+	scull_lat_record(dev, SCULL_LAT_WRITE, ns);
+	trace_scull_write(MINOR(dev->cdev.dev), filp, pos, count, retval, ns);
+
+	scull_qos_refund(dev, cgid, retval > 0 ? count - retval : count,
+			 retval < 0);
+
+	if (retval > 0) {
+		scull_delay_io(dev, true, retval);
+	}
+	return retval;
+}
+
+static ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
+			  loff_t *f_pos)
+{
+	struct iov_iter iter;
+
+	ssize_t retval = import_ubuf(ITER_DEST, buf, count, &iter);
+	if (retval) {
+		return retval;
+	}
+
+	return scull_do_read(filp, &iter, f_pos, scull_qos_cgroup_id());
+}
+
+static ssize_t scull_write(struct file *filp, const char __user *buf,
+			   size_t count, loff_t *f_pos)
+{
+	struct iov_iter iter;
+
+	ssize_t retval = import_ubuf(ITER_SOURCE, (char __user *)buf, count,
+				     &iter);
+	if (retval) {
+		return retval;
+	}
+
+	return scull_do_write(filp, &iter, f_pos, scull_qos_cgroup_id());
+}
+
+/*
+ * readv() and asynchronous reads. Large asynchronous requests are queued
+ * to a worker, so that their submitter does not wait for the copy.
+ */
+static ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *iter)
+{
+	if (scull_aio_async(iocb, iter)) {
+		return scull_aio_queue(iocb, iter, false);
+	}
+	return scull_do_read(iocb->ki_filp, iter, &iocb->ki_pos,
+			     scull_qos_cgroup_id());
+}
+
+static ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *iter)
+{
+	if (scull_aio_async(iocb, iter)) {
+		return scull_aio_queue(iocb, iter, true);
+	}
+	return scull_do_write(iocb->ki_filp, iter, &iocb->ki_pos,
+			      scull_qos_cgroup_id());
+}
+
+static loff_t scull_llseek(struct file *filp, loff_t off, int whence)
+{
+	struct scull_dev *dev = filp->private_data;
+	loff_t newpos;
+
+	switch (whence) {
+	case SEEK_SET:
+		newpos = off;
+		break;
+	case SEEK_CUR:
+		newpos = filp->f_pos + off;
+		break;
+	case SEEK_END:
+		newpos = READ_ONCE(dev->size) + off;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (newpos < 0) {
+		return -EINVAL;
+	}
+	filp->f_pos = newpos;
+	trace_scull_llseek(MINOR(dev->cdev.dev), filp, off, whence, newpos);
+	return newpos;
+}
+
+static int scull_fsync(struct file *filp, loff_t start, loff_t end,
+		       int datasync)
+{
+	struct scull_dev *dev = filp->private_data;
+
+	if (!dev->cache) {
+		return 0;
+	}
+	return scull_cache_fsync(dev, datasync);
+}
+
+/*
+ * Report the ranges written after a given generation.
+ * Quanta are scanned in device order and adjacent ones are coalesced.
+ */
+static long scull_ioc_changes(struct scull_dev *dev,
+			      struct scull_changes __user *uarg)
+{
+	struct scull_changes ch;
+
+	if (copy_from_user(&ch, uarg, sizeof(ch))) {
+		return -EFAULT;
+	}
+
+	struct scull_range __user *uranges = u64_to_user_ptr(ch.ranges);
+	struct scull_range range = { 0 };
+	u32 nr_ranges = 0;
+	long retval = 0;
+
+	if (scull_lock_interruptible(dev)) {
+		return -ERESTARTSYS;
+	}
+
+	int quantum = dev->quantum;
+	int qset = dev->qset;
+	long itemsize = quantum * qset;
+
+	long pos = (long)ch.start - (long)ch.start % quantum;
+	int s_pos = (pos % itemsize) / quantum;
+
+	struct scull_qset *dptr = dev->data;
+	for (long item = pos / itemsize; dptr && item; item--) {
+		dptr = dptr->next;
+	}
+
+	ch.next = dev->size;
+
+	for (; dptr && pos < dev->size; pos += quantum) {
+		const bool changed = dptr->gen && dptr->gen[s_pos] > ch.since;
+
+		if (changed && range.length &&
+		    range.offset + range.length == pos) {
+			range.length += quantum;
+		} else if (changed) {
+			if (range.length) {
+				if (nr_ranges == ch.nr_ranges) {
+					ch.next = range.offset;
+					range.length = 0;
+					break;
+				}
+				if (copy_to_user(uranges + nr_ranges, &range,
+						 sizeof(range))) {
+					retval = -EFAULT;
+					goto out;
+				}
+				nr_ranges++;
+			}
+			range.offset = pos;
+			range.length = quantum;
+		}
+
+		if (++s_pos == qset) {
+			s_pos = 0;
+			dptr = dptr->next;
+		}
+	}
+
+	if (range.length) {
+		range.length = min_t(u64, range.length,
+				     dev->size - range.offset);
+		if (nr_ranges == ch.nr_ranges) {
+			ch.next = range.offset;
+		} else if (copy_to_user(uranges + nr_ranges, &range,
+					sizeof(range))) {
+			retval = -EFAULT;
+			goto out;
+		} else {
+			nr_ranges++;
+		}
+	}
+
+	ch.nr_ranges = nr_ranges;
+	ch.flags = ch.since < dev->trim_gen ? SCULL_CHANGES_RESET : 0;
+	ch.gen = dev->gen;
+	ch.size = dev->size;
+
+out:
+	scull_unlock(dev);
+
+	if (!retval && copy_to_user(uarg, &ch, sizeof(ch))) {
+		retval = -EFAULT;
+	}
+	return retval;
+}
+
+/*
+ * Report the memory footprint of the device, or of all devices.
+ */
+static long scull_ioc_mem(struct scull_dev *dev,
+			  struct scull_mem_info __user *uarg)
+{
+	struct scull_mem_info info;
+
+	if (copy_from_user(&info, uarg, sizeof(info))) {
+		return -EFAULT;
+	}
+	if (info.flags & ~SCULL_MEM_ALL) {
+		return -EINVAL;
+	}
+
+	int first = dev - scull_devices;
+	int last = first + 1;
+
+	if (info.flags & SCULL_MEM_ALL) {
+		first = 0;
+		last = scull_num_devs;
+	}
+
+	u32 flags = info.flags;
+
+	memset(&info, 0, sizeof(info));
+	info.flags = flags;
+
+	for (int i = first; i < last; i++) {
+		if (scull_lock_interruptible(scull_devices + i)) {
+			return -ERESTARTSYS;
+		}
+		scull_mem_add(scull_devices + i, &info);
+		scull_unlock(scull_devices + i);
+	}
+
+	if (copy_to_user(uarg, &info, sizeof(info))) {
+		return -EFAULT;
+	}
+	return 0;
+}
+
+static long scull_ioc_stats(struct scull_dev *dev,
+			    struct scull_stats_info __user *uarg)
+{
+	struct scull_stats_info *info = kzalloc(sizeof(*info), GFP_KERNEL);
+	long retval = 0;
+
+	if (!info) {
+		return -ENOMEM;
+	}
+
+	retval = scull_stats_fill(dev, info);
+	if (!retval && copy_to_user(uarg, info, sizeof(*info))) {
+		retval = -EFAULT;
+	}
+
+	kfree(info);
+	return retval;
+}
+
+static long scull_ioc_export(struct scull_dev *dev, struct file *filp,
+			     struct scull_export __user *uarg)
+{
+	struct scull_export exp;
+
+	if (copy_from_user(&exp, uarg, sizeof(exp))) {
+		return -EFAULT;
+	}
+	if (exp.pad) {
+		return -EINVAL;
+	}
+
+	return scull_dmabuf_export(dev, &exp, filp->f_mode & FMODE_WRITE);
+}
+
+static long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct scull_dev *dev = filp->private_data;
+
+	if (_IOC_TYPE(cmd) != SCULL_IOC_MAGIC || _IOC_NR(cmd) > SCULL_IOC_MAXNR) {
+		return -ENOTTY;
+	}
+
+	switch (cmd) {
+	case SCULL_IOCGCHANGES:
+		return scull_ioc_changes(dev, (void __user *)arg);
+	case SCULL_IOCGMEM:
+		return scull_ioc_mem(dev, (void __user *)arg);
+	case SCULL_IOCGSTATS:
+		return scull_ioc_stats(dev, (void __user *)arg);
+	case SCULL_IOCEXPORT:
+		return scull_ioc_export(dev, filp, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static void scull_cleanup(void)
+{
+	dev_t devno = MKDEV(scull_major, scull_minor);
+
+	/*
+	 * First, as its files point into the devices and do not pin the
+	 * module. Removal waits for the accesses in progress.
+	 */
+	debugfs_remove_recursive(scull_debugfs_root);
+	scull_debugfs_root = NULL;
+
+	scull_aio_cleanup();
+
+	if (scull_devices) {
+		for (int i = 0; i < scull_num_devs; ++i) {
+			scull_cache_cleanup(scull_devices + i);
+			scull_reserve_cleanup(scull_devices + i);
+			scull_trim(scull_devices + i);
+			cdev_del(&scull_devices[i].cdev);
+			scull_stats_cleanup(scull_devices + i);
+			scull_latency_cleanup(scull_devices + i);
+		}
+		kfree(scull_devices);
+	}
+
+	/* scull_cleanup is not call if registering fails */
+	unregister_chrdev_region(devno, 4);
+}
+
+static int scull_setup_cdev(struct scull_dev *dev, int major, int minor,
+			    int index)
+{
+	int err;
+	dev_t devno = MKDEV(major, minor + index);
+
+	cdev_init(&dev->cdev, &scull_fops);
+	dev->cdev.owner = THIS_MODULE;
+	dev->cdev.ops = &scull_fops;
+	err = cdev_add(&dev->cdev, devno, 1);
+
+	if (err) {
+		pr_err("Error %d adding scull%d", err, index);
+	}
+
+	return err;
+}
+
+static int __init scull_init(void)
+{
+	dev_t devno;
+	int err;
+	if (scull_major) {
+		devno = MKDEV(scull_major, scull_minor);
+		err = register_chrdev_region(devno, 4, "scull");
+	} else {
+		err = alloc_chrdev_region(&devno, 0, 4, "scull");
+		scull_major = MAJOR(devno);
+		scull_minor = MINOR(devno);
+	}
+
+	if (err)
+		return err;
+
+	scull_devices = kzalloc(4 * sizeof(struct scull_dev), GFP_KERNEL);
+	if (!scull_devices) {
+		err = -ENOMEM;
+		goto fail_unregister;
+	}
+
+	scull_debugfs_root = debugfs_create_dir("scull", NULL);
+
+	for (int i = 0; i < 4; i++) {
+		struct scull_dev *dev = &scull_devices[i];
+		char name[16];
+
+		dev->quantum = scull_quantum;
+		dev->qset = scull_qset;
+		snprintf(name, sizeof(name), "scull%d", i);
+		dev->debugfs = debugfs_create_dir(name, scull_debugfs_root);
+		scull_lock_init(dev);
+		scull_layout_init(dev);
+		scull_heat_init(dev);
+		debugfs_create_bool("stream", 0644, dev->debugfs, &dev->stream);
+		scull_delay_init(dev);
+		scull_qos_init(dev);
+		err = scull_latency_init(dev);
+		if (!err) {
+			err = scull_stats_init(dev);
+		}
+		if (err) {
+			goto fail;
+		}
+		scull_reserve_init(dev);
+		err = scull_cache_init(dev, i);
+		if (err) {
+			goto fail;
+		}
+		err = scull_setup_cdev(dev, scull_major, scull_minor, i);
+		if (err) {
+			goto fail;
+		}
+	}
+
+	err = scull_aio_init();
+	if (err) {
+		goto fail;
+	}
+
+	/* last, as scull_cleanup does not undo it */
+	err = sbull_init(scull_devices, 4);
+	if (err) {
+		goto fail;
+	}
+
+#ifdef SCULL_BENCH
+	scull_bench_init(scull_debugfs_root);
+#endif
+
+#ifdef SCULL_DEBUG
+	scull_proc_create();
+#endif
+
+	return 0;
+
+fail:
+	scull_cleanup();
+	return err;
+
+fail_unregister:
+	unregister_chrdev_region(devno, 4);
+	return err;
+}
+
+static void __exit scull_exit(void)
+{
+#ifdef SCULL_DEBUG
+	scull_proc_remove();
+#endif
+
+	sbull_cleanup();
+	scull_cleanup();
+}
+
+module_init(scull_init);
+module_exit(scull_exit);
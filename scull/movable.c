@@ -0,0 +1,133 @@
+#include <linux/migrate.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/pagemap.h>
+
+#include "scull.h"
+
+/*
+ * Movable quanta.
+ * Quanta of one page are allocated as movable pages and registered with
+ * the compaction code, so that long lived devices do not pin unmovable
+ * pages all over memory. Each page records its device and the slot of
+ * its qset pointing to it; migration copies the page and repoints the
+ * slot under dev->lock.
+ *
+ * Migration runs with the page locked, and a quantum is freed with
+ * dev->lock held and then the page lock, so the migration only tries
+ * dev->lock and gives up when it is busy. Pages also referenced by a
+ * dma-buf are not migrated.
+ */
+
+static bool scull_movable_quanta = true;
+
+module_param(scull_movable_quanta, bool, S_IRUGO);
+
+/* Reference of the device and the one of the isolation */
+#define SCULL_MOVABLE_REFS 2
+
+bool scull_movable(struct scull_dev *dev)
+{
+	return scull_movable_quanta && !IS_ENABLED(CONFIG_HIGHMEM) &&
+	       dev->quantum == PAGE_SIZE;
+}
+
+static bool scull_movable_isolate(struct page *page, isolate_mode_t mode)
+{
+	return true;
+}
+
+static const struct movable_operations scull_movable_ops;
+
+/*
+ * Must be called with the page locked.
+ */
+static void scull_movable_own(struct page *page, struct scull_dev *dev,
+			      void **slot)
+{
+	set_page_private(page, (unsigned long)dev);
+	page->index = (pgoff_t)slot;
+	__SetPageMovable(page, &scull_movable_ops);
+}
+
+static int scull_movable_migrate(struct page *dst, struct page *src,
+				 enum migrate_mode mode)
+{
+	struct scull_dev *dev = (struct scull_dev *)page_private(src);
+	void **slot = (void **)src->index;
+
+	if (!mutex_trylock(&dev->lock)) {
+		return -EAGAIN;
+	}
+	if (page_count(src) != SCULL_MOVABLE_REFS ||
+	    WARN_ON_ONCE(*slot != page_address(src))) {
+		mutex_unlock(&dev->lock);
+		return -EBUSY;
+	}
+
+	copy_highpage(dst, src);
+	get_page(dst);
+	scull_movable_own(dst, dev, slot);
+	*slot = page_address(dst);
+
+	__ClearPageMovable(src);
+	set_page_private(src, 0);
+	src->index = 0;
+	put_page(src);
+
+	scull_stat_inc(dev, migrations);
+	mutex_unlock(&dev->lock);
+
+	return MIGRATEPAGE_SUCCESS;
+}
+
+static void scull_movable_putback(struct page *page)
+{
+}
+
+static const struct movable_operations scull_movable_ops = {
+	.isolate_page = scull_movable_isolate,
+	.migrate_page = scull_movable_migrate,
+	.putback_page = scull_movable_putback,
+};
+
+/*
+ * Allocate a zeroed page for a quantum, movable once adopted.
+ */
+void *scull_movable_alloc(gfp_t gfp)
+{
+	struct page *page = alloc_page(gfp | __GFP_MOVABLE | __GFP_ZERO);
+
+	return page ? page_address(page) : NULL;
+}
+
+/*
+ * Make the page of a quantum movable, slot pointing to it.
+ * Must be called with lock held, slot being set before it is released.
+ */
+void scull_movable_adopt(struct scull_dev *dev, void *data, void **slot)
+{
+	struct page *page = virt_to_page(data);
+
+	lock_page(page);
+	scull_movable_own(page, dev, slot);
+	unlock_page(page);
+}
+
+/*
+ * Drop the reference of the device to the page of a quantum. A migration
+ * in progress then leaves the page alone.
+ * Must be called with lock held.
+ */
+void scull_movable_free(void *data)
+{
+	struct page *page = virt_to_page(data);
+
+	lock_page(page);
+	__ClearPageMovable(page);
+	set_page_private(page, 0);
+	page->index = 0;
+	unlock_page(page);
+
+	put_page(page);
+}
@@ -0,0 +1,259 @@
+#include <linux/cgroup.h>
+#include <linux/debugfs.h>
+#include <linux/math64.h>
+#include <linux/sched/signal.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+#include "scull.h"
+
+/*
+ * I/O rate limiting, per device and per cgroup.
+ *
+ * Each limit is a token bucket, implemented as a virtual clock: a transfer
+ * advances the clock by the time it costs at the configured rate, and must
+ * wait until the clock catches up with the real time. The clock never lags
+ * the real time by more than qos_burst_ms, which is the bucket size.
+ *
+ * Readers and writers are charged before taking dev->lock, so that a
+ * throttled task never holds it while waiting. The unused part of the charge
+ * is refunded after the transfer.
+ *
+ * Per cgroup limits are set by writing "<cgroup id> <bytes/s> <ops/s>" to
+ * the qos_cgroups debugfs file. The cgroup id is the inode number of its
+ * directory in the cgroup2 hierarchy. Writing zero rates removes the limit.
+ */
+
+/*
+ * cgroup of the current task, charged for its transfers.
+ */
+u64 scull_qos_cgroup_id(void)
+{
+#ifdef CONFIG_CGROUPS
+	u64 id;
+
+	rcu_read_lock();
+	id = cgroup_id(task_dfl_cgroup(current));
+	rcu_read_unlock();
+	return id;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Charge amount to a bucket.
+ * Returns when the charge is covered, in ns of the monotonic clock.
+ */
+static u64 scull_tbucket_charge(struct scull_tbucket *tb, u64 amount, u64 now,
+				u64 burst)
+{
+	if (!tb->rate) {
+		return now;
+	}
+	if (tb->clock + burst < now) {
+		tb->clock = now - burst;
+	}
+	tb->clock += mul_u64_u64_div_u64(amount, NSEC_PER_SEC, tb->rate);
+	return tb->clock;
+}
+
+static void scull_tbucket_refund(struct scull_tbucket *tb, u64 amount)
+{
+	if (!tb->rate) {
+		return;
+	}
+	tb->clock -= min(tb->clock,
+			 mul_u64_u64_div_u64(amount, NSEC_PER_SEC, tb->rate));
+}
+
+/*
+ * Find the group of a cgroup, or NULL if it is not limited.
+ * Must be called with qos->lock held.
+ */
+static struct scull_qos_group *scull_qos_group(struct scull_qos *qos, u64 cgid)
+{
+	for (int i = 0; i < qos->nr_groups; i++) {
+		if (qos->groups[i].cgid == cgid) {
+			return &qos->groups[i];
+		}
+	}
+	return NULL;
+}
+
+static bool scull_qos_enabled(struct scull_qos *qos)
+{
+	return READ_ONCE(qos->bytes.rate) || READ_ONCE(qos->ops.rate) ||
+	       READ_ONCE(qos->nr_groups);
+}
+
+/*
+ * Charge a transfer of count bytes to cgroup cgid, and wait until the
+ * limits allow it.
+ * Must be called without the lock held.
+ */
+int scull_qos_charge(struct scull_dev *dev, u64 cgid, size_t count)
+{
+	struct scull_qos *qos = &dev->qos;
+
+	if (!scull_qos_enabled(qos)) {
+		return 0;
+	}
+
+	u64 now = ktime_get_ns();
+	u64 burst = (u64)READ_ONCE(qos->burst_ms) * NSEC_PER_MSEC;
+	u64 deadline;
+
+	spin_lock(&qos->lock);
+
+	deadline = scull_tbucket_charge(&qos->bytes, count, now, burst);
+	deadline = max(deadline,
+		       scull_tbucket_charge(&qos->ops, 1, now, burst));
+
+	struct scull_qos_group *grp = scull_qos_group(qos, cgid);
+	if (grp) {
+		deadline = max(deadline, scull_tbucket_charge(&grp->bytes,
+							      count, now,
+							      burst));
+		deadline = max(deadline,
+			       scull_tbucket_charge(&grp->ops, 1, now, burst));
+	}
+
+	spin_unlock(&qos->lock);
+
+	if (deadline <= now) {
+		return 0;
+	}
+
+	scull_delay_until(deadline);
+
+	if (signal_pending(current)) {
+		scull_qos_refund(dev, cgid, count, true);
+		return -ERESTARTSYS;
+	}
+
+	return 0;
+}
+
+/*
+ * Give back the charge of count bytes not transferred, and of the
+ * operation itself if it was not done.
+ */
+void scull_qos_refund(struct scull_dev *dev, u64 cgid, size_t count,
+		      bool op)
+{
+	struct scull_qos *qos = &dev->qos;
+
+	if (!count && !op) {
+		return;
+	}
+	if (!scull_qos_enabled(qos)) {
+		return;
+	}
+
+	spin_lock(&qos->lock);
+
+	scull_tbucket_refund(&qos->bytes, count);
+	if (op) {
+		scull_tbucket_refund(&qos->ops, 1);
+	}
+
+	struct scull_qos_group *grp = scull_qos_group(qos, cgid);
+	if (grp) {
+		scull_tbucket_refund(&grp->bytes, count);
+		if (op) {
+			scull_tbucket_refund(&grp->ops, 1);
+		}
+	}
+
+	spin_unlock(&qos->lock);
+}
+
+static int scull_qos_cgroups_show(struct seq_file *s, void *v)
+{
+	struct scull_qos *qos = &((struct scull_dev *)s->private)->qos;
+
+	spin_lock(&qos->lock);
+	for (int i = 0; i < qos->nr_groups; i++) {
+		struct scull_qos_group *grp = &qos->groups[i];
+
+		seq_printf(s, "%llu %llu %llu\n", grp->cgid, grp->bytes.rate,
+			   grp->ops.rate);
+	}
+	spin_unlock(&qos->lock);
+
+	return 0;
+}
+
+static int scull_qos_cgroups_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, scull_qos_cgroups_show, inode->i_private);
+}
+
+static ssize_t scull_qos_cgroups_write(struct file *file,
+				       const char __user *ubuf, size_t count,
+				       loff_t *ppos)
+{
+	struct scull_dev *dev = file_inode(file)->i_private;
+	struct scull_qos *qos = &dev->qos;
+	u64 cgid, bps, iops;
+	ssize_t retval = count;
+
+	char *buf = memdup_user_nul(ubuf, min_t(size_t, count, 64));
+	if (IS_ERR(buf)) {
+		return PTR_ERR(buf);
+	}
+	if (sscanf(buf, "%llu %llu %llu", &cgid, &bps, &iops) != 3) {
+		kfree(buf);
+		return -EINVAL;
+	}
+	kfree(buf);
+
+	spin_lock(&qos->lock);
+
+	struct scull_qos_group *grp = scull_qos_group(qos, cgid);
+
+	if (!bps && !iops) {
+		if (grp) {
+			*grp = qos->groups[--qos->nr_groups];
+		}
+	} else if (grp || qos->nr_groups < SCULL_QOS_GROUPS) {
+		if (!grp) {
+			grp = &qos->groups[qos->nr_groups++];
+			memset(grp, 0, sizeof(*grp));
+			grp->cgid = cgid;
+		}
+		grp->bytes.rate = bps;
+		grp->ops.rate = iops;
+	} else {
+		retval = -ENOSPC;
+	}
+
+	spin_unlock(&qos->lock);
+
+	return retval;
+}
+
+static const struct file_operations scull_qos_cgroups_fops = {
+	.owner = THIS_MODULE,
+	.open = scull_qos_cgroups_open,
+	.read = seq_read,
+	.write = scull_qos_cgroups_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+void scull_qos_init(struct scull_dev *dev)
+{
+	struct scull_qos *qos = &dev->qos;
+
+	spin_lock_init(&qos->lock);
+	qos->burst_ms = 100;
+
+	debugfs_create_u64("qos_bps", 0644, dev->debugfs, &qos->bytes.rate);
+	debugfs_create_u64("qos_iops", 0644, dev->debugfs, &qos->ops.rate);
+	debugfs_create_u32("qos_burst_ms", 0644, dev->debugfs, &qos->burst_ms);
+	debugfs_create_file("qos_cgroups", 0644, dev->debugfs, dev,
+			    &scull_qos_cgroups_fops);
+}
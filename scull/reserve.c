@@ -0,0 +1,278 @@
+#include <linux/debugfs.h>
+#include <linux/mempool.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "scull.h"
+
+/*
+ * Reserve of memory for writes under memory pressure.
+ * Each device keeps mempools of scull_reserve quanta and of enough qset
+ * nodes and arrays to hold them. The engine first tries allocations that
+ * never enter direct reclaim, and falls back on the reserve, so that a write
+ * in progress goes on through a pressure spike rather than stalling in
+ * reclaim or failing with -ENOMEM. Taking from the reserve never waits,
+ * and only takes preallocated elements, so that its counts are exact.
+ * Once it is empty, allocations may reclaim again.
+ *
+ * A worker refills the reserve after it is used, and builds new pools
+ * when a trim changes the geometry of the device. The pools are only
+ * replaced by the worker, under dev->lock, which also protects the counts
+ * of their elements.
+ */
+
+static unsigned int scull_reserve = 16; /* Quanta, 0 for no reserve */
+
+module_param(scull_reserve, uint, S_IRUGO);
+
+/* Node, data, gen and dirty arrays of a qset */
+#define SCULL_RESERVE_QSET_ALLOCS 4
+
+static void *scull_reserve_alloc_page(gfp_t gfp, void *pool_data)
+{
+	return scull_movable_alloc(gfp);
+}
+
+static void scull_reserve_free_page(void *element, void *pool_data)
+{
+	free_page((unsigned long)element);
+}
+
+static void *scull_reserve_alloc_quantum(gfp_t gfp, void *pool_data)
+{
+	size_t size = (size_t)pool_data;
+
+	if (PAGE_ALIGNED(size)) {
+		return alloc_pages_exact(size, gfp | __GFP_ZERO);
+	}
+	return kzalloc(size, gfp);
+}
+
+static void scull_reserve_free_quantum(void *element, void *pool_data)
+{
+	size_t size = (size_t)pool_data;
+
+	if (PAGE_ALIGNED(size)) {
+		free_pages_exact(element, size);
+	} else {
+		kfree(element);
+	}
+}
+
+static void *scull_reserve_alloc_meta(gfp_t gfp, void *pool_data)
+{
+	return kzalloc((size_t)pool_data, gfp);
+}
+
+static void scull_reserve_destroy(struct scull_reserve *res)
+{
+	mempool_destroy(res->quanta);
+	mempool_destroy(res->meta);
+}
+
+static void *scull_reserve_new(struct scull_reserve *res, bool meta)
+{
+	if (meta) {
+		return scull_reserve_alloc_meta(GFP_KERNEL,
+						(void *)res->meta_size);
+	}
+	if (res->movable) {
+		return scull_reserve_alloc_page(GFP_KERNEL, NULL);
+	}
+	return scull_reserve_alloc_quantum(GFP_KERNEL, (void *)res->quantum);
+}
+
+/*
+ * Top up a pool to target elements, nr counting them, with allocations
+ * that may reclaim.
+ */
+static void scull_reserve_fill(struct scull_dev *dev, mempool_t *pool,
+			       int *nr, int target, bool meta)
+{
+	scull_lock(dev);
+	int missing = target - *nr;
+	scull_unlock(dev);
+
+	for (; missing > 0; missing--) {
+		void *p = scull_reserve_new(&dev->reserve, meta);
+
+		if (!p) {
+			break;
+		}
+
+		scull_lock(dev);
+		mempool_free(p, pool); /* freed if the pool is full */
+		*nr = min(*nr + 1, target);
+		scull_unlock(dev);
+	}
+}
+
+static void scull_reserve_work(struct work_struct *work)
+{
+	struct scull_reserve *res =
+		container_of(work, struct scull_reserve, refill);
+	struct scull_dev *dev = container_of(res, struct scull_dev, reserve);
+	struct scull_reserve new = { 0 };
+
+	scull_lock(dev);
+	new.quantum = dev->quantum;
+	new.movable = scull_movable(dev);
+	new.meta_size = max(sizeof(struct scull_qset), dev->qset * sizeof(u64));
+	new.min_meta = SCULL_RESERVE_QSET_ALLOCS *
+		       (DIV_ROUND_UP(scull_reserve, dev->qset) + 1);
+	bool stale = !res->quanta || res->quantum != new.quantum ||
+		     res->movable != new.movable ||
+		     res->meta_size != new.meta_size;
+	scull_unlock(dev);
+
+	if (!stale) {
+		scull_reserve_fill(dev, res->quanta, &res->nr_quanta,
+				   scull_reserve, false);
+		scull_reserve_fill(dev, res->meta, &res->nr_meta,
+				   res->min_meta, true);
+		return;
+	}
+
+	if (new.movable) {
+		new.quanta = mempool_create(scull_reserve,
+					    scull_reserve_alloc_page,
+					    scull_reserve_free_page, NULL);
+	} else {
+		new.quanta = mempool_create(scull_reserve,
+					    scull_reserve_alloc_quantum,
+					    scull_reserve_free_quantum,
+					    (void *)new.quantum);
+	}
+	new.meta = mempool_create(new.min_meta, scull_reserve_alloc_meta,
+				  mempool_kfree, (void *)new.meta_size);
+	if (!new.quanta || !new.meta) {
+		/* tried again the next time the reserve is needed */
+		scull_reserve_destroy(&new);
+		return;
+	}
+
+	/* the pools are created full */
+	scull_lock(dev);
+	swap(res->quanta, new.quanta);
+	swap(res->meta, new.meta);
+	res->quantum = new.quantum;
+	res->movable = new.movable;
+	res->meta_size = new.meta_size;
+	res->min_meta = new.min_meta;
+	res->nr_quanta = scull_reserve;
+	res->nr_meta = new.min_meta;
+	scull_unlock(dev);
+
+	scull_reserve_destroy(&new);
+}
+
+/*
+ * Refill the reserve in the background, and adapt it to the geometry of
+ * the device.
+ */
+void scull_reserve_refill(struct scull_dev *dev)
+{
+	/* no worker before scull_reserve_init and after the cleanup */
+	if (scull_reserve && dev->reserve.refill.func) {
+		queue_work(system_unbound_wq, &dev->reserve.refill);
+	}
+}
+
+/*
+ * Take a zeroed quantum from the reserve. Returns NULL when it is empty or
+ * does not match the geometry of the device.
+ * Must be called with lock held.
+ */
+void *scull_reserve_quantum(struct scull_dev *dev)
+{
+	struct scull_reserve *res = &dev->reserve;
+	void *p = NULL;
+
+	if (!scull_reserve) {
+		return NULL;
+	}
+
+	if (res->quanta && res->quantum == dev->quantum &&
+	    res->movable == scull_movable(dev)) {
+		p = mempool_alloc_preallocated(res->quanta);
+	}
+
+	if (p) {
+		res->nr_quanta--;
+		scull_stat_inc(dev, reserve_quanta);
+	} else {
+		scull_stat_inc(dev, reserve_empty);
+	}
+	scull_reserve_refill(dev);
+
+	return p;
+}
+
+/*
+ * Take zeroed metadata of size bytes from the reserve.
+ * Must be called with lock held.
+ */
+void *scull_reserve_meta(struct scull_dev *dev, size_t size)
+{
+	struct scull_reserve *res = &dev->reserve;
+	void *p = NULL;
+
+	if (!scull_reserve) {
+		return NULL;
+	}
+
+	if (res->meta && size <= res->meta_size) {
+		p = mempool_alloc_preallocated(res->meta);
+	}
+
+	if (p) {
+		res->nr_meta--;
+		scull_stat_inc(dev, reserve_meta);
+	} else {
+		scull_stat_inc(dev, reserve_empty);
+	}
+	scull_reserve_refill(dev);
+
+	return p;
+}
+
+static int scull_reserve_show(struct seq_file *s, void *v)
+{
+	struct scull_dev *dev = s->private;
+	struct scull_reserve *res = &dev->reserve;
+
+	scull_lock(dev);
+	if (res->quanta) {
+		seq_printf(s, "quanta %d/%u\n", res->nr_quanta, scull_reserve);
+		seq_printf(s, "meta %d/%d\n", res->nr_meta, res->min_meta);
+	}
+	scull_unlock(dev);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(scull_reserve);
+
+void scull_reserve_init(struct scull_dev *dev)
+{
+	INIT_WORK(&dev->reserve.refill, scull_reserve_work);
+	debugfs_create_file("reserve", 0444, dev->debugfs, dev,
+			    &scull_reserve_fops);
+	scull_reserve_refill(dev);
+}
+
+void scull_reserve_cleanup(struct scull_dev *dev)
+{
+	struct scull_reserve *res = &dev->reserve;
+
+	/* not initialized if the module failed to load before the device */
+	if (!res->refill.func) {
+		return;
+	}
+	cancel_work_sync(&res->refill);
+	scull_reserve_destroy(res);
+	memset(res, 0, sizeof(*res));
+}
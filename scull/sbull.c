@@ -0,0 +1,690 @@
+#include <linux/module.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/sched/mm.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+
+#include "scull.h"
+
+/*
+ * sbull exposes the scull devices as block devices.
+ * The storage is shared with the char devices: sbullN and scullN are two
+ * views of the same quanta, serialized by the same lock. A request holds
+ * that lock for its whole transfer, so a disk has a single hardware queue:
+ * more would only contend on the lock.
+ * Discarded and zeroed ranges are deallocated, so they read as holes.
+ *
+ * When sbull_zone_size_mb is set, the disks are host-managed zoned devices.
+ * The first sbull_zone_nr_conv zones are conventional, the others must be
+ * written sequentially at their write pointer. The quanta of a sequential
+ * zone are allocated when it is opened and freed when it is reset, so that
+ * writes to an open zone do not allocate memory.
+ */
+
+static int sbull_major = 0;
+static int sbull_size_mb = 0; /* Capacity of each disk, 0 to disable sbull */
+static int sbull_queue_depth = 128;
+static int sbull_zone_size_mb = 0; /* Zone size, 0 for a regular disk */
+static int sbull_zone_nr_conv = 0; /* Number of conventional zones */
+static int sbull_zone_max_open = 0; /* Max open zones, 0 for no limit */
+
+module_param(sbull_size_mb, int, S_IRUGO);
+module_param(sbull_queue_depth, int, S_IRUGO);
+module_param(sbull_zone_size_mb, int, S_IRUGO);
+module_param(sbull_zone_nr_conv, int, S_IRUGO);
+module_param(sbull_zone_max_open, int, S_IRUGO);
+
+#define SBULL_MINORS 16
+
+struct sbull_zone {
+	sector_t start;
+	sector_t wp;
+	enum blk_zone_type type;
+	enum blk_zone_cond cond;
+};
+
+struct sbull_dev {
+	struct scull_dev *dev;
+	struct blk_mq_tag_set tag_set;
+	struct gendisk *disk;
+	struct sbull_zone *zones; /* NULL if the disk is not zoned */
+	unsigned int nr_zones;
+	unsigned int nr_open; /* Implicitly and explicitly open zones */
+	sector_t zone_sectors;
+};
+
+static struct sbull_dev *sbull_devices = NULL;
+static int sbull_num_devs = 0;
+
+static int sbull_report_zones(struct gendisk *disk, sector_t sector,
+			      unsigned int nr_zones, report_zones_cb cb,
+			      void *data);
+
+static const struct block_device_operations sbull_fops = {
+	.owner = THIS_MODULE,
+	.report_zones = sbull_report_zones,
+};
+
+/*
+ * Set up iter over the data of a read or write request, so that it is
+ * transferred by a single call to the engine. The bvecs of a request of
+ * several bios are gathered in an array, returned in bvecs for the caller
+ * to free; a single bio is iterated in place.
+ */
+static int sbull_rq_iter(struct request *rq, struct iov_iter *iter,
+			 struct bio_vec **bvecs)
+{
+	const bool write = op_is_write(req_op(rq));
+	struct req_iterator rq_iter;
+	struct bio_vec bvec, *bv;
+	unsigned int nr_bvec = 0;
+	size_t offset = 0;
+
+	rq_for_each_bvec(bvec, rq, rq_iter) {
+		nr_bvec++;
+	}
+
+	if (rq->bio != rq->biotail) {
+		bv = kmalloc_array(nr_bvec, sizeof(struct bio_vec), GFP_NOIO);
+		if (!bv) {
+			return -ENOMEM;
+		}
+		*bvecs = bv;
+		rq_for_each_bvec(bvec, rq, rq_iter) {
+			*bv++ = bvec;
+		}
+		bv = *bvecs;
+	} else {
+		/* past the part of the first bvec already done */
+		offset = rq->bio->bi_iter.bi_bvec_done;
+		bv = __bvec_iter_bvec(rq->bio->bi_io_vec, rq->bio->bi_iter);
+	}
+
+	iov_iter_bvec(iter, write ? ITER_SOURCE : ITER_DEST, bv, nr_bvec,
+		      blk_rq_bytes(rq));
+	iter->iov_offset = offset;
+
+	return 0;
+}
+
+/*
+ * Transfer the data of a read or write request at pos.
+ * Must be called with lock held.
+ */
+static blk_status_t sbull_transfer(struct scull_dev *dev,
+				   struct iov_iter *iter, loff_t pos)
+{
+	size_t count = iov_iter_count(iter);
+	ssize_t ret;
+
+	if (iov_iter_rw(iter) == WRITE) {
+		ret = scull_copy_from_iter(dev, iter, pos);
+	} else {
+		ret = scull_copy_to_iter(dev, iter, pos);
+		/* past the end of the scull device */
+		if (ret >= 0 && ret < count) {
+			ret += iov_iter_zero(count - ret, iter);
+		}
+	}
+	if (ret < 0) {
+		return errno_to_blk_status(ret);
+	}
+	if (ret < count) {
+		return BLK_STS_IOERR;
+	}
+
+	return BLK_STS_OK;
+}
+
+/*
+ * Zoned model
+ * All zone state is protected by the lock of the scull device.
+ */
+
+static struct sbull_zone *sbull_zone(struct sbull_dev *sdev, sector_t sector)
+{
+	return &sdev->zones[sector / sdev->zone_sectors];
+}
+
+static loff_t sbull_zone_pos(struct sbull_zone *zone)
+{
+	return zone->start << SECTOR_SHIFT;
+}
+
+static bool sbull_zone_is_open(struct sbull_zone *zone)
+{
+	return zone->cond == BLK_ZONE_COND_IMP_OPEN ||
+	       zone->cond == BLK_ZONE_COND_EXP_OPEN;
+}
+
+static void sbull_zone_close(struct sbull_dev *sdev, struct sbull_zone *zone)
+{
+	if (!sbull_zone_is_open(zone)) {
+		return;
+	}
+	sdev->nr_open--;
+	zone->cond = zone->wp == zone->start ? BLK_ZONE_COND_EMPTY :
+					       BLK_ZONE_COND_CLOSED;
+}
+
+/*
+ * Open a zone, implicitly on write or explicitly.
+ * An empty zone gets all its quanta allocated.
+ */
+static blk_status_t sbull_zone_open(struct sbull_dev *sdev,
+				    struct sbull_zone *zone,
+				    enum blk_zone_cond cond)
+{
+	struct scull_dev *dev = sdev->dev;
+
+	if (sbull_zone_is_open(zone)) {
+		if (cond == BLK_ZONE_COND_EXP_OPEN) {
+			zone->cond = cond;
+		}
+		return BLK_STS_OK;
+	}
+	if (zone->cond == BLK_ZONE_COND_FULL) {
+		return cond == BLK_ZONE_COND_EXP_OPEN ? BLK_STS_OK :
+							BLK_STS_IOERR;
+	}
+
+	if (sbull_zone_max_open && sdev->nr_open >= sbull_zone_max_open) {
+		/* make room by closing an implicitly open zone */
+		struct sbull_zone *victim = NULL;
+
+		for (unsigned int i = 0; i < sdev->nr_zones && !victim; i++) {
+			if (sdev->zones[i].cond == BLK_ZONE_COND_IMP_OPEN) {
+				victim = &sdev->zones[i];
+			}
+		}
+		if (!victim) {
+			return BLK_STS_ZONE_OPEN_RESOURCE;
+		}
+		sbull_zone_close(sdev, victim);
+	}
+
+	if (zone->cond == BLK_ZONE_COND_EMPTY) {
+		int err = scull_alloc_range(dev, sbull_zone_pos(zone),
+					    sdev->zone_sectors << SECTOR_SHIFT);
+		if (err) {
+			return errno_to_blk_status(err);
+		}
+	}
+
+	zone->cond = cond;
+	sdev->nr_open++;
+
+	return BLK_STS_OK;
+}
+
+static blk_status_t sbull_zone_reset(struct sbull_dev *sdev,
+				     struct sbull_zone *zone)
+{
+	if (zone->type == BLK_ZONE_TYPE_CONVENTIONAL) {
+		return BLK_STS_IOERR;
+	}
+	if (zone->cond == BLK_ZONE_COND_EMPTY) {
+		return BLK_STS_OK;
+	}
+
+	int err = scull_punch_hole(sdev->dev, sbull_zone_pos(zone),
+				   sdev->zone_sectors << SECTOR_SHIFT);
+	if (err) {
+		return errno_to_blk_status(err);
+	}
+
+	if (sbull_zone_is_open(zone)) {
+		sdev->nr_open--;
+	}
+	zone->wp = zone->start;
+	zone->cond = BLK_ZONE_COND_EMPTY;
+
+	return BLK_STS_OK;
+}
+
+static blk_status_t sbull_zone_finish(struct sbull_dev *sdev,
+				      struct sbull_zone *zone)
+{
+	sector_t end = zone->start + sdev->zone_sectors;
+
+	if (zone->type == BLK_ZONE_TYPE_CONVENTIONAL) {
+		return BLK_STS_IOERR;
+	}
+
+	/* free the quanta allocated when the zone was opened */
+	int err = scull_punch_hole(sdev->dev, zone->wp << SECTOR_SHIFT,
+				   (end - zone->wp) << SECTOR_SHIFT);
+	if (err) {
+		return errno_to_blk_status(err);
+	}
+
+	if (sbull_zone_is_open(zone)) {
+		sdev->nr_open--;
+	}
+	zone->wp = end;
+	zone->cond = BLK_ZONE_COND_FULL;
+
+	return BLK_STS_OK;
+}
+
+static blk_status_t sbull_zone_write(struct sbull_dev *sdev,
+				     struct request *rq, struct iov_iter *iter)
+{
+	struct sbull_zone *zone = sbull_zone(sdev, blk_rq_pos(rq));
+	const bool append = req_op(rq) == REQ_OP_ZONE_APPEND;
+	sector_t sector = append ? zone->wp : blk_rq_pos(rq);
+	sector_t end = zone->start + sdev->zone_sectors;
+	blk_status_t status;
+
+	if (zone->type == BLK_ZONE_TYPE_CONVENTIONAL) {
+		if (append) {
+			return BLK_STS_IOERR;
+		}
+		return sbull_transfer(sdev->dev, iter, sector << SECTOR_SHIFT);
+	}
+
+	if (sector != zone->wp || zone->wp + blk_rq_sectors(rq) > end) {
+		return BLK_STS_IOERR;
+	}
+
+	status = sbull_zone_open(sdev, zone, BLK_ZONE_COND_IMP_OPEN);
+	if (status != BLK_STS_OK) {
+		return status;
+	}
+
+	status = sbull_transfer(sdev->dev, iter, sector << SECTOR_SHIFT);
+	if (status != BLK_STS_OK) {
+		return status;
+	}
+
+	if (append) {
+		rq->__sector = sector;
+	}
+	zone->wp += blk_rq_sectors(rq);
+	if (zone->wp == end) {
+		sdev->nr_open--;
+		zone->cond = BLK_ZONE_COND_FULL;
+	}
+
+	return BLK_STS_OK;
+}
+
+static blk_status_t sbull_zone_mgmt(struct sbull_dev *sdev,
+				    struct request *rq)
+{
+	struct sbull_zone *zone = sbull_zone(sdev, blk_rq_pos(rq));
+	blk_status_t status = BLK_STS_OK;
+
+	if (req_op(rq) != REQ_OP_ZONE_RESET_ALL &&
+	    zone->type == BLK_ZONE_TYPE_CONVENTIONAL) {
+		return BLK_STS_IOERR;
+	}
+
+	switch (req_op(rq)) {
+	case REQ_OP_ZONE_RESET_ALL:
+		for (unsigned int i = 0; i < sdev->nr_zones; i++) {
+			if (sdev->zones[i].type ==
+			    BLK_ZONE_TYPE_SEQWRITE_REQ) {
+				status = sbull_zone_reset(sdev,
+							  &sdev->zones[i]);
+			}
+			if (status != BLK_STS_OK) {
+				break;
+			}
+		}
+		break;
+	case REQ_OP_ZONE_RESET:
+		status = sbull_zone_reset(sdev, zone);
+		break;
+	case REQ_OP_ZONE_OPEN:
+		status = sbull_zone_open(sdev, zone, BLK_ZONE_COND_EXP_OPEN);
+		break;
+	case REQ_OP_ZONE_CLOSE:
+		sbull_zone_close(sdev, zone);
+		break;
+	case REQ_OP_ZONE_FINISH:
+		status = sbull_zone_finish(sdev, zone);
+		break;
+	default:
+		status = BLK_STS_NOTSUPP;
+		break;
+	}
+
+	return status;
+}
+
+static int sbull_report_zones(struct gendisk *disk, sector_t sector,
+			      unsigned int nr_zones, report_zones_cb cb,
+			      void *data)
+{
+	struct sbull_dev *sdev = disk->private_data;
+	unsigned int first = sector / sdev->zone_sectors;
+	unsigned int i;
+
+	for (i = 0; i < nr_zones && first + i < sdev->nr_zones; i++) {
+		struct sbull_zone *zone = &sdev->zones[first + i];
+		struct blk_zone blkz = {
+			.start = zone->start,
+			.len = sdev->zone_sectors,
+			.capacity = sdev->zone_sectors,
+			.type = zone->type,
+		};
+
+		scull_lock(sdev->dev);
+		blkz.wp = zone->wp;
+		blkz.cond = zone->cond;
+		scull_unlock(sdev->dev);
+
+		int err = cb(&blkz, first + i, data);
+		if (err) {
+			return err;
+		}
+	}
+
+	return i;
+}
+
+static int sbull_init_zones(struct sbull_dev *sdev, struct queue_limits *lim)
+{
+	sector_t capacity = (sector_t)sbull_size_mb << (20 - SECTOR_SHIFT);
+
+	sdev->zone_sectors = (sector_t)sbull_zone_size_mb
+			     << (20 - SECTOR_SHIFT);
+	if (!is_power_of_2(sdev->zone_sectors)) {
+		pr_err("sbull: zone size must be a power of 2\n");
+		return -EINVAL;
+	}
+	sdev->nr_zones = capacity / sdev->zone_sectors;
+	if (!sdev->nr_zones) {
+		return -EINVAL;
+	}
+
+	sdev->zones = kvcalloc(sdev->nr_zones, sizeof(struct sbull_zone),
+			       GFP_KERNEL);
+	if (!sdev->zones) {
+		return -ENOMEM;
+	}
+
+	for (unsigned int i = 0; i < sdev->nr_zones; i++) {
+		struct sbull_zone *zone = &sdev->zones[i];
+
+		zone->start = zone->wp = i * sdev->zone_sectors;
+		if (i < sbull_zone_nr_conv) {
+			zone->type = BLK_ZONE_TYPE_CONVENTIONAL;
+			zone->cond = BLK_ZONE_COND_NOT_WP;
+			zone->wp = (sector_t)-1;
+		} else {
+			zone->type = BLK_ZONE_TYPE_SEQWRITE_REQ;
+			zone->cond = BLK_ZONE_COND_EMPTY;
+		}
+	}
+
+	lim->features |= BLK_FEAT_ZONED;
+	lim->chunk_sectors = sdev->zone_sectors;
+	lim->max_zone_append_sectors = sdev->zone_sectors;
+	lim->max_open_zones = sbull_zone_max_open;
+	lim->max_hw_discard_sectors = 0;
+	lim->max_write_zeroes_sectors = 0;
+
+	return 0;
+}
+
+static blk_status_t sbull_do_request(struct sbull_dev *sdev,
+				     struct request *rq)
+{
+	struct scull_dev *dev = sdev->dev;
+	loff_t pos = blk_rq_pos(rq) << SECTOR_SHIFT;
+	blk_status_t status;
+
+	if (req_op(rq) == REQ_OP_FLUSH) {
+		if (!dev->cache) {
+			return BLK_STS_OK;
+		}
+		return errno_to_blk_status(scull_cache_fsync(dev, 0));
+	}
+
+	struct bio_vec *bvecs = NULL;
+	struct iov_iter iter;
+
+	if (req_op(rq) == REQ_OP_READ || req_op(rq) == REQ_OP_WRITE ||
+	    req_op(rq) == REQ_OP_ZONE_APPEND) {
+		int err = sbull_rq_iter(rq, &iter, &bvecs);
+		if (err) {
+			return errno_to_blk_status(err);
+		}
+	}
+
+	scull_lock(dev);
+
+	switch (req_op(rq)) {
+	case REQ_OP_READ:
+		status = sbull_transfer(dev, &iter, pos);
+		break;
+	case REQ_OP_WRITE:
+	case REQ_OP_ZONE_APPEND:
+		if (sdev->zones) {
+			status = sbull_zone_write(sdev, rq, &iter);
+		} else {
+			status = sbull_transfer(dev, &iter, pos);
+		}
+		break;
+	case REQ_OP_ZONE_RESET:
+	case REQ_OP_ZONE_RESET_ALL:
+	case REQ_OP_ZONE_OPEN:
+	case REQ_OP_ZONE_CLOSE:
+	case REQ_OP_ZONE_FINISH:
+		if (sdev->zones) {
+			status = sbull_zone_mgmt(sdev, rq);
+		} else {
+			status = BLK_STS_NOTSUPP;
+		}
+		break;
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		status = errno_to_blk_status(
+			scull_punch_hole(dev, pos, blk_rq_bytes(rq)));
+		break;
+	default:
+		status = BLK_STS_NOTSUPP;
+		break;
+	}
+
+	scull_unlock(dev);
+	kfree(bvecs);
+
+	if (status == BLK_STS_OK && (req_op(rq) == REQ_OP_READ ||
+				     op_is_write(req_op(rq)))) {
+		scull_delay_io(dev, op_is_write(req_op(rq)), blk_rq_bytes(rq));
+	}
+
+	return status;
+}
+
+static blk_status_t sbull_queue_rq(struct blk_mq_hw_ctx *hctx,
+				   const struct blk_mq_queue_data *bd)
+{
+	struct sbull_dev *sdev = hctx->queue->queuedata;
+	struct request *rq = bd->rq;
+
+	blk_mq_start_request(rq);
+
+	/* do not recurse into the block layer to reclaim memory */
+	unsigned int noio_flags = memalloc_noio_save();
+	blk_status_t status = sbull_do_request(sdev, rq);
+	memalloc_noio_restore(noio_flags);
+
+	blk_mq_end_request(rq, status);
+
+	return BLK_STS_OK;
+}
+
+static const struct blk_mq_ops sbull_mq_ops = {
+	.queue_rq = sbull_queue_rq,
+};
+
+static int sbull_setup_disk(struct sbull_dev *sdev, struct scull_dev *dev,
+			    int index)
+{
+	struct blk_mq_tag_set *set = &sdev->tag_set;
+	int err;
+
+	sdev->dev = dev;
+
+	/* blocking, the lock is taken in queue_rq */
+	set->ops = &sbull_mq_ops;
+	set->nr_hw_queues = 1;
+	set->nr_maps = 1;
+	set->queue_depth = sbull_queue_depth;
+	set->numa_node = NUMA_NO_NODE;
+	set->flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+
+	err = blk_mq_alloc_tag_set(set);
+	if (err) {
+		return err;
+	}
+
+	struct queue_limits lim = {
+		.logical_block_size = SECTOR_SIZE,
+		.physical_block_size = PAGE_SIZE,
+		.max_hw_discard_sectors = UINT_MAX,
+		.discard_granularity = dev->quantum,
+		.max_write_zeroes_sectors = UINT_MAX,
+	};
+	if (dev->cache) {
+		lim.features |= BLK_FEAT_WRITE_CACHE;
+	}
+	if (sbull_zone_size_mb) {
+		err = sbull_init_zones(sdev, &lim);
+		if (err) {
+			goto fail_tag_set;
+		}
+	}
+
+	sdev->disk = blk_mq_alloc_disk(set, &lim, sdev);
+	if (IS_ERR(sdev->disk)) {
+		err = PTR_ERR(sdev->disk);
+		sdev->disk = NULL;
+		goto fail_tag_set;
+	}
+
+	struct gendisk *disk = sdev->disk;
+
+	disk->major = sbull_major;
+	disk->first_minor = index * SBULL_MINORS;
+	disk->minors = SBULL_MINORS;
+	disk->fops = &sbull_fops;
+	disk->private_data = sdev;
+	snprintf(disk->disk_name, DISK_NAME_LEN, "sbull%d", index);
+	set_capacity(disk, (sector_t)sbull_size_mb << (20 - SECTOR_SHIFT));
+
+	if (sdev->zones) {
+		err = blk_revalidate_disk_zones(disk);
+		if (err) {
+			goto fail_disk;
+		}
+	}
+
+	err = add_disk(disk);
+	if (err) {
+		goto fail_disk;
+	}
+
+	return 0;
+
+fail_disk:
+	put_disk(disk);
+	sdev->disk = NULL;
+fail_tag_set:
+	blk_mq_free_tag_set(set);
+	kvfree(sdev->zones);
+	sdev->zones = NULL;
+	return err;
+}
+
+static void sbull_remove_disk(struct sbull_dev *sdev)
+{
+	if (!sdev->disk) {
+		return;
+	}
+	del_gendisk(sdev->disk);
+	put_disk(sdev->disk);
+	blk_mq_free_tag_set(&sdev->tag_set);
+	kvfree(sdev->zones);
+}
+
+int sbull_init(struct scull_dev *devs, int num_devs)
+{
+	int err;
+
+	if (sbull_size_mb <= 0) {
+		return 0;
+	}
+
+	err = register_blkdev(sbull_major, "sbull");
+	if (err < 0) {
+		return err;
+	}
+	sbull_major = err;
+
+	sbull_devices = kcalloc(num_devs, sizeof(struct sbull_dev), GFP_KERNEL);
+	if (!sbull_devices) {
+		err = -ENOMEM;
+		goto fail_unregister;
+	}
+	sbull_num_devs = num_devs;
+
+	for (int i = 0; i < num_devs; i++) {
+		err = sbull_setup_disk(sbull_devices + i, devs + i, i);
+		if (err) {
+			pr_err("Error %d adding sbull%d", err, i);
+			sbull_cleanup();
+			return err;
+		}
+	}
+
+	return 0;
+
+fail_unregister:
+	unregister_blkdev(sbull_major, "sbull");
+	return err;
+}
+
+/*
+ * Reset the zones of the disk over dev, whose data was trimmed.
+ * Must be called with lock held.
+ */
+void sbull_trim(struct scull_dev *dev)
+{
+	for (int i = 0; sbull_devices && i < sbull_num_devs; i++) {
+		struct sbull_dev *sdev = sbull_devices + i;
+
+		if (sdev->dev != dev || !sdev->zones) {
+			continue;
+		}
+		for (unsigned int z = 0; z < sdev->nr_zones; z++) {
+			struct sbull_zone *zone = &sdev->zones[z];
+
+			if (zone->type == BLK_ZONE_TYPE_SEQWRITE_REQ) {
+				zone->wp = zone->start;
+				zone->cond = BLK_ZONE_COND_EMPTY;
+			}
+		}
+		sdev->nr_open = 0;
+	}
+}
+
+void sbull_cleanup(void)
+{
+	if (!sbull_devices) {
+		return;
+	}
+
+	for (int i = 0; i < sbull_num_devs; i++) {
+		sbull_remove_disk(sbull_devices + i);
+	}
+	kfree(sbull_devices);
+	sbull_devices = NULL;
+
+	unregister_blkdev(sbull_major, "sbull");
+}
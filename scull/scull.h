@@ -1,5 +1,8 @@
 #pragma once
 
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
 #define SCULL_DEBUG 1
 
 #ifndef SCULL_MAJOR
@@ -17,3 +20,577 @@
 #ifndef SCULL_QSET
 #define SCULL_QSET 1000
 #endif
+
+/*
+ * Ioctl definitions
+ */
+
+#define SCULL_IOC_MAGIC 'k'
+
+/* A byte range of a scull device */
+struct scull_range {
+	__u64 offset;
+	__u64 length;
+};
+
+/*
+ * Argument of SCULL_IOCGCHANGES.
+ *
+ * Reports the quanta written or deallocated after generation `since`, as
+ * coalesced ranges, scanning the device from offset `start`. At most
+ * `nr_ranges` ranges are copied to the `ranges` array, and `nr_ranges` is
+ * updated with the number of ranges filled. `next` is the offset where the
+ * following call must start, it equals `size` when the whole device was
+ * scanned.
+ *
+ * `gen` is the current generation of the device. It is the value to pass
+ * as `since` in the next sync round, and must be taken from the call of the
+ * round that had `start == 0`.
+ *
+ * SCULL_CHANGES_RESET is set in `flags` if the device was trimmed after
+ * `since`. In that case, data not reported in `ranges` is gone.
+ */
+struct scull_changes {
+	__u64 since; /* in */
+	__u64 start; /* in */
+	__u64 ranges; /* in: pointer to an array of struct scull_range */
+	__u32 nr_ranges; /* in/out */
+	__u32 flags; /* out */
+	__u64 gen; /* out */
+	__u64 next; /* out */
+	__u64 size; /* out */
+};
+
+#define SCULL_CHANGES_RESET 0x1
+
+#define SCULL_IOCGCHANGES _IOWR(SCULL_IOC_MAGIC, 1, struct scull_changes)
+
+#define SCULL_STATS_VERSION 1
+#define SCULL_STATS_LAT_NR 4
+#define SCULL_STATS_LAT_BUCKETS 32
+
+/*
+ * Argument of SCULL_IOCGMEM.
+ *
+ * Reports the memory used by the device, or by all scull devices if
+ * SCULL_MEM_ALL is set in `flags`. `quanta` counts the quanta that have
+ * memory and `written` those of them that hold written data, the others
+ * being preallocated or faulted in. `holes` counts the quanta below the
+ * device size that have no memory, and `tail_waste` is the part of the last
+ * quantum that is past the end of the device. `past_size` counts the quanta
+ * with memory that start past the end of the device, as preallocated for
+ * the zones of sbull.
+ */
+struct scull_mem_info {
+	__u32 flags; /* in */
+	__u32 pad;
+	__u64 size; /* out */
+	__u64 data_bytes; /* out: quanta */
+	__u64 meta_bytes; /* out: qset nodes and arrays */
+	__u64 quanta; /* out */
+	__u64 written; /* out */
+	__u64 holes; /* out */
+	__u64 tail_waste; /* out: in bytes */
+	__u64 past_size; /* out */
+};
+
+#define SCULL_MEM_ALL 0x1
+
+#define SCULL_IOCGMEM _IOWR(SCULL_IOC_MAGIC, 2, struct scull_mem_info)
+
+/*
+ * Statistics of a device, argument of SCULL_IOCGSTATS.
+ *
+ * The same structure is in the stats.bin debugfs file of the device, which
+ * can be mapped read-only and is then refreshed every scull_stats_ms. `seq`
+ * is odd while the mapped copy is being refreshed: a reader must read `seq`,
+ * then the fields, then `seq` again, and retry if it was odd or changed.
+ *
+ * Fields are only ever added at the end, with an increment of `version`.
+ * Latency buckets are as in the latency debugfs file, bucket i counting
+ * the durations in [2^(i-1), 2^i) ns.
+ */
+struct scull_stats_info {
+	__u32 version;
+	__u32 size; /* of the structure */
+	__u32 seq;
+	__u32 pad;
+	__u64 time_ns; /* CLOCK_MONOTONIC time of the snapshot */
+	__u64 dev_size;
+	__u64 quantum;
+	__u64 qset;
+	/* operation counters */
+	__u64 reads;
+	__u64 writes;
+	__u64 read_bytes;
+	__u64 write_bytes;
+	__u64 trims;
+	__u64 allocs;
+	__u64 alloc_fails;
+	__u64 lock_acquired;
+	__u64 lock_contended;
+	__u64 lock_wait_ns;
+	__u64 lock_hold_ns;
+	/* memory footprint, as in struct scull_mem_info */
+	__u64 data_bytes;
+	__u64 meta_bytes;
+	__u64 quanta;
+	__u64 written;
+	/* latency histograms: read, write, lock wait and trim */
+	__u64 latency[SCULL_STATS_LAT_NR][SCULL_STATS_LAT_BUCKETS];
+};
+
+#define SCULL_IOCGSTATS _IOR(SCULL_IOC_MAGIC, 3, struct scull_stats_info)
+
+/*
+ * Argument of SCULL_IOCEXPORT, which returns a dma-buf file descriptor.
+ *
+ * Exports the range [offset, offset + length) of the device as a dma-buf
+ * sharing the pages of its quanta: it can be mapped, vmapped and attached
+ * to devices, and data written through it is data of the device. The range
+ * must be page aligned and the quantum a multiple of the page size, in
+ * memory mode. Holes in the range are allocated, and a device open for
+ * writing is extended to cover the range, read-only exports must be within
+ * the device. The length is limited by the scull_export_max parameter. The
+ * dma-buf is writable if the device is open for writing.
+ *
+ * The dma-buf keeps its pages for its whole life, including after they
+ * leave the device on trim or hole punching. Writes through it are not
+ * reported by SCULL_IOCGCHANGES.
+ *
+ * `flags` takes O_CLOEXEC, for the returned descriptor.
+ */
+struct scull_export {
+	__u64 offset;
+	__u64 length;
+	__u32 flags;
+	__u32 pad;
+};
+
+#define SCULL_IOCEXPORT _IOW(SCULL_IOC_MAGIC, 4, struct scull_export)
+
+#define SCULL_IOC_MAXNR 4
+
+#ifdef __KERNEL__
+
+#include <linux/cdev.h>
+#include <linux/ktime.h>
+#include <linux/mempool.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+struct iov_iter;
+struct scull_cache;
+
+/* Latency and bandwidth injection knobs (delay.c) */
+struct scull_delay {
+	u32 read_lat_us;
+	u32 write_lat_us;
+	u32 jitter_us;
+	u32 dist;
+	u64 read_bw; /* bytes per second, 0 for no limit */
+	u64 write_bw;
+	spinlock_t lock;
+	u64 bw_next[2]; /* When the read and write channels get free, in ns */
+};
+
+/* Rate limit, as a token bucket (qos.c) */
+struct scull_tbucket {
+	u64 rate; /* per second, 0 for no limit */
+	u64 clock; /* Virtual time consumed, in ns */
+};
+
+struct scull_qos_group {
+	u64 cgid;
+	struct scull_tbucket bytes;
+	struct scull_tbucket ops;
+};
+
+#define SCULL_QOS_GROUPS 16
+
+struct scull_qos {
+	spinlock_t lock;
+	u32 burst_ms;
+	struct scull_tbucket bytes;
+	struct scull_tbucket ops;
+	int nr_groups;
+	struct scull_qos_group groups[SCULL_QOS_GROUPS];
+};
+
+/* Reserve of quanta and qset memory (reserve.c) */
+struct scull_reserve {
+	mempool_t *quanta;
+	mempool_t *meta; /* qset nodes and arrays */
+	size_t quantum; /* Size of the elements of quanta */
+	bool movable; /* quanta holds pages for movable quanta */
+	size_t meta_size; /* Size of the elements of meta */
+	int min_meta;
+	int nr_quanta; /* Elements left */
+	int nr_meta;
+	struct work_struct refill;
+};
+
+/* Operation counters, per CPU (stats.c) */
+struct scull_stats {
+	u64 reads;
+	u64 writes;
+	u64 read_bytes;
+	u64 write_bytes;
+	u64 trims;
+	u64 allocs;
+	u64 alloc_fails;
+	u64 migrations; /* Quanta moved by compaction */
+	u64 reserve_quanta; /* Allocations served by the reserve */
+	u64 reserve_meta;
+	u64 reserve_empty; /* Allocations the reserve could not serve */
+	u64 lock_acquired;
+	u64 lock_contended;
+	u64 lock_wait_ns;
+	u64 lock_hold_ns;
+};
+
+#define scull_stat_add(dev, field, n) this_cpu_add((dev)->stats->field, (n))
+#define scull_stat_inc(dev, field) this_cpu_inc((dev)->stats->field)
+
+/* Latency histograms, per CPU (latency.c) */
+enum scull_lat_type {
+	SCULL_LAT_READ,
+	SCULL_LAT_WRITE,
+	SCULL_LAT_LOCK, /* Wait for dev->lock */
+	SCULL_LAT_TRIM,
+	SCULL_LAT_NR,
+};
+
+/* Bucket i counts the durations in [2^(i-1), 2^i) ns, the last one is open */
+#define SCULL_LAT_BUCKETS 32
+
+struct scull_latency {
+	u64 hist[SCULL_LAT_NR][SCULL_LAT_BUCKETS];
+};
+
+/* Access heat map, maintained under dev->lock (heat.c) */
+#define SCULL_HEAT_REGIONS 64
+
+struct scull_heat {
+	u32 reads[SCULL_HEAT_REGIONS];
+	u32 writes[SCULL_HEAT_REGIONS];
+	int shift; /* log2 of the region size */
+	unsigned long epoch; /* Half-lives elapsed at the last decay */
+	unsigned int tick; /* Accesses not sampled */
+};
+
+/* Memory footprint, maintained under dev->lock */
+struct scull_mem {
+	u64 data_bytes;
+	u64 meta_bytes;
+	u64 quanta; /* Quanta with memory */
+	u64 written; /* Quanta with memory and a write generation */
+};
+
+/* Hold time of dev->lock (lock.c) */
+struct scull_lockstat {
+	u64 since; /* When the holder took the lock, in ns */
+	unsigned long ip; /* Where the holder took it */
+	u64 max_hold_ns;
+	unsigned long max_hold_ip;
+};
+
+struct scull_qset {
+	void **data;
+	u64 *gen; /* Generation of the last write of each quantum */
+	unsigned long *dirty; /* Quanta to write back, in cache mode */
+	struct scull_qset *next;
+};
+
+struct scull_dev {
+	struct scull_qset *data;
+	struct scull_qset *hint; /* Last qset looked up */
+	int hint_item; /* Index of hint in data */
+	int quantum; /* Current quantum size */
+	int qset; /* Current array size */
+	unsigned long size;
+	u64 gen; /* Generation of the last write */
+	u64 trim_gen; /* Generation of the last trim */
+	unsigned int access_key;
+	struct scull_mem mem;
+	struct scull_heat heat;
+	struct mutex lock;
+	struct scull_lockstat lockstat;
+	struct cdev cdev;
+	struct scull_cache *cache; /* NULL if not backed by a file */
+	struct scull_delay delay;
+	struct scull_qos qos;
+	bool stream; /* Non-temporal copies of large transfers */
+	struct scull_reserve reserve;
+	struct scull_stats __percpu *stats;
+	struct scull_stats_info *stats_page; /* Mapped by stats.bin */
+	struct delayed_work stats_work; /* Refresh of stats_page */
+	atomic_t stats_maps; /* Mappings of stats_page */
+	struct scull_latency __percpu *lat;
+	struct dentry *debugfs;
+};
+
+static inline void scull_lat_record(struct scull_dev *dev,
+				    enum scull_lat_type type, u64 ns)
+{
+	int bucket = min(fls64(ns), SCULL_LAT_BUCKETS - 1);
+
+	this_cpu_inc(dev->lat->hist[type][bucket]);
+}
+
+/*
+ * Lock helpers, recording the time spent waiting for dev->lock, the time
+ * it is held and where it was taken.
+ * An uncontended acquisition is not timed.
+ */
+
+extern unsigned int scull_lock_warn_us;
+
+void scull_lock_held_long(struct scull_dev *dev, u64 held);
+
+static inline void scull_locked(struct scull_dev *dev, unsigned long ip,
+				u64 now, u64 wait)
+{
+	dev->lockstat.since = now;
+	dev->lockstat.ip = ip;
+	scull_stat_inc(dev, lock_acquired);
+	if (wait) {
+		scull_stat_inc(dev, lock_contended);
+		scull_stat_add(dev, lock_wait_ns, wait);
+	}
+	scull_lat_record(dev, SCULL_LAT_LOCK, wait);
+}
+
+static inline void __scull_lock(struct scull_dev *dev, unsigned long ip)
+{
+	if (mutex_trylock(&dev->lock)) {
+		scull_locked(dev, ip, ktime_get_ns(), 0);
+		return;
+	}
+
+	u64 start = ktime_get_ns();
+	mutex_lock(&dev->lock);
+	u64 now = ktime_get_ns();
+	scull_locked(dev, ip, now, now - start);
+}
+
+static inline int __scull_lock_interruptible(struct scull_dev *dev,
+					     unsigned long ip)
+{
+	if (mutex_trylock(&dev->lock)) {
+		scull_locked(dev, ip, ktime_get_ns(), 0);
+		return 0;
+	}
+
+	u64 start = ktime_get_ns();
+	if (mutex_lock_interruptible(&dev->lock)) {
+		return -ERESTARTSYS;
+	}
+	u64 now = ktime_get_ns();
+	scull_locked(dev, ip, now, now - start);
+	return 0;
+}
+
+#define scull_lock(dev) __scull_lock(dev, _THIS_IP_)
+#define scull_lock_interruptible(dev) __scull_lock_interruptible(dev, _THIS_IP_)
+
+static inline void scull_unlock(struct scull_dev *dev)
+{
+	u64 held = ktime_get_ns() - dev->lockstat.since;
+	u64 warn = (u64)READ_ONCE(scull_lock_warn_us) * NSEC_PER_USEC;
+
+	scull_stat_add(dev, lock_hold_ns, held);
+	if (held > dev->lockstat.max_hold_ns || (warn && held > warn)) {
+		scull_lock_held_long(dev, held);
+	}
+	mutex_unlock(&dev->lock);
+}
+
+/*
+ * Storage engine (engine.c)
+ */
+
+extern int scull_quantum;
+extern int scull_qset;
+
+ssize_t scull_copy_to_iter(struct scull_dev *dev, struct iov_iter *iter,
+			   loff_t pos);
+ssize_t __scull_copy_from_iter(struct scull_dev *dev, struct iov_iter *iter,
+			       loff_t pos, bool nocache);
+int scull_punch_hole(struct scull_dev *dev, loff_t pos, size_t len);
+int scull_alloc_range(struct scull_dev *dev, loff_t pos, size_t len);
+int scull_trim(struct scull_dev *dev);
+struct scull_qset *scull_follow(struct scull_dev *dev, int n);
+void *scull_alloc_data(struct scull_dev *dev, void **slot);
+void scull_free_data(struct scull_dev *dev, void *data);
+void scull_free_quantum(struct scull_dev *dev, struct scull_qset *dptr,
+			int s_pos);
+void *scull_quantum_at(struct scull_dev *dev, loff_t pos, bool write);
+u64 scull_quanta_from(struct scull_dev *dev, u64 first);
+
+static inline ssize_t scull_copy_from_iter(struct scull_dev *dev,
+					   struct iov_iter *iter, loff_t pos)
+{
+	return __scull_copy_from_iter(dev, iter, pos, false);
+}
+
+/*
+ * Kernel API for other modules (api.c)
+ */
+
+/* Quantum lent by scull_borrow, until scull_return */
+struct scull_borrow {
+	struct scull_dev *dev;
+	void *data; /* NULL for a hole, which reads as zeros */
+	size_t len; /* Usable bytes at data */
+	loff_t pos;
+	bool write;
+};
+
+struct scull_dev *scull_get_device(int index);
+ssize_t scull_read_iter_at(struct scull_dev *dev, struct iov_iter *iter,
+			   loff_t pos);
+ssize_t scull_write_iter_at(struct scull_dev *dev, struct iov_iter *iter,
+			    loff_t pos);
+ssize_t scull_kernel_read(struct scull_dev *dev, void *buf, size_t count,
+			  loff_t pos);
+ssize_t scull_kernel_write(struct scull_dev *dev, const void *buf,
+			   size_t count, loff_t pos);
+int scull_borrow(struct scull_dev *dev, loff_t pos, bool write,
+		 struct scull_borrow *b);
+void scull_return(struct scull_borrow *b, size_t written);
+
+/*
+ * Character device (main.c)
+ */
+
+ssize_t scull_do_read(struct file *filp, struct iov_iter *iter, loff_t *f_pos,
+		      u64 cgid);
+ssize_t scull_do_write(struct file *filp, struct iov_iter *iter,
+		       loff_t *f_pos, u64 cgid);
+
+/*
+ * Asynchronous I/O (aio.c)
+ */
+
+int scull_aio_init(void);
+void scull_aio_cleanup(void);
+bool scull_aio_async(struct kiocb *iocb, struct iov_iter *iter);
+ssize_t scull_aio_queue(struct kiocb *iocb, struct iov_iter *iter, bool write);
+
+/*
+ * Operation counters (stats.c)
+ */
+
+int scull_stats_init(struct scull_dev *dev);
+void scull_stats_cleanup(struct scull_dev *dev);
+void scull_stats_sum(struct scull_dev *dev, struct scull_stats *sum);
+int scull_stats_fill(struct scull_dev *dev, struct scull_stats_info *info);
+
+/*
+ * Latency histograms (latency.c)
+ */
+
+int scull_latency_init(struct scull_dev *dev);
+void scull_latency_cleanup(struct scull_dev *dev);
+void scull_latency_sum(struct scull_dev *dev, struct scull_latency *sum);
+
+/*
+ * Lock instrumentation (lock.c)
+ */
+
+void scull_lock_init(struct scull_dev *dev);
+
+/*
+ * Access heat map (heat.c)
+ */
+
+void scull_heat_init(struct scull_dev *dev);
+void scull_heat_record(struct scull_dev *dev, bool write, loff_t pos,
+		       size_t len);
+void scull_heat_reset(struct scull_dev *dev);
+
+/*
+ * Layout map (layout.c)
+ */
+
+void scull_layout_init(struct scull_dev *dev);
+
+/*
+ * Movable quanta (movable.c)
+ */
+
+bool scull_movable(struct scull_dev *dev);
+void *scull_movable_alloc(gfp_t gfp);
+void scull_movable_adopt(struct scull_dev *dev, void *data, void **slot);
+void scull_movable_free(void *data);
+
+/*
+ * Write reserve (reserve.c)
+ */
+
+void scull_reserve_init(struct scull_dev *dev);
+void scull_reserve_cleanup(struct scull_dev *dev);
+void scull_reserve_refill(struct scull_dev *dev);
+void *scull_reserve_quantum(struct scull_dev *dev);
+void *scull_reserve_meta(struct scull_dev *dev, size_t size);
+
+/*
+ * dma-buf export (dmabuf.c)
+ */
+
+int scull_dmabuf_export(struct scull_dev *dev, const struct scull_export *exp,
+			bool writable);
+
+/*
+ * Write-back cache over a backing file (cache.c)
+ */
+
+int scull_cache_init(struct scull_dev *dev, int index);
+void scull_cache_cleanup(struct scull_dev *dev);
+int scull_cache_fault(struct scull_dev *dev, struct scull_qset *dptr, int s_pos,
+		      loff_t pos);
+void scull_cache_dirty(struct scull_dev *dev, struct scull_qset *dptr,
+		       int s_pos);
+int scull_cache_discard(struct scull_dev *dev, loff_t pos, loff_t len);
+void scull_cache_drop(struct scull_dev *dev, struct scull_qset *dptr,
+		      int s_pos);
+void scull_cache_trim(struct scull_dev *dev);
+int scull_cache_fsync(struct scull_dev *dev, int datasync);
+
+/*
+ * Latency and bandwidth injection (delay.c)
+ */
+
+void scull_delay_init(struct scull_dev *dev);
+void scull_delay_io(struct scull_dev *dev, bool write, size_t count);
+
+void scull_delay_until(u64 deadline);
+
+/*
+ * I/O rate limiting (qos.c)
+ */
+
+void scull_qos_init(struct scull_dev *dev);
+u64 scull_qos_cgroup_id(void);
+int scull_qos_charge(struct scull_dev *dev, u64 cgid, size_t count);
+void scull_qos_refund(struct scull_dev *dev, u64 cgid, size_t count,
+		      bool op);
+
+/*
+ * Microbenchmarks (bench.c), built with SCULL_BENCH
+ */
+
+void scull_bench_init(struct dentry *root);
+
+/*
+ * Block device front end (sbull.c)
+ */
+
+int sbull_init(struct scull_dev *devs, int num_devs);
+void sbull_cleanup(void);
+void sbull_trim(struct scull_dev *dev);
+
+#endif /* __KERNEL__ */
@@ -0,0 +1,334 @@
+#include <kunit/test.h>
+#include <linux/completion.h>
+#include <linux/kthread.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+
+#include "scull.h"
+
+/*
+ * KUnit tests of the storage engine, built in with "make kunit" or
+ * CONFIG_SCULL_KUNIT_TEST. They run on private devices with small quanta
+ * and qsets, so that transfers cross many boundaries. Under UML, with
+ * this directory in the tree:
+ *   ./tools/testing/kunit/kunit.py run --kunitconfig=drivers/scull
+ */
+
+#define SCULL_TEST_QUANTUM 16
+#define SCULL_TEST_QSET 4
+#define SCULL_TEST_ITEM (SCULL_TEST_QUANTUM * SCULL_TEST_QSET)
+#define SCULL_TEST_SIZE (4 * SCULL_TEST_ITEM)
+
+static void scull_test_free(void *data)
+{
+	struct scull_dev *dev = data;
+
+	/* not scull_lock, which counts in dev->stats */
+	mutex_lock(&dev->lock);
+	scull_trim(dev);
+	mutex_unlock(&dev->lock);
+
+	free_percpu(dev->lat);
+	free_percpu(dev->stats);
+	kfree(dev);
+}
+
+static struct scull_dev *scull_test_dev(struct kunit *test)
+{
+	struct scull_dev *dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_NULL(test, dev);
+
+	dev->quantum = SCULL_TEST_QUANTUM;
+	dev->qset = SCULL_TEST_QSET;
+	mutex_init(&dev->lock);
+	scull_heat_reset(dev);
+	KUNIT_ASSERT_EQ(test,
+			kunit_add_action_or_reset(test, scull_test_free, dev),
+			0);
+	dev->stats = alloc_percpu(struct scull_stats);
+	KUNIT_ASSERT_NOT_NULL(test, dev->stats);
+	dev->lat = alloc_percpu(struct scull_latency);
+	KUNIT_ASSERT_NOT_NULL(test, dev->lat);
+
+	return dev;
+}
+
+static ssize_t scull_test_rw(struct scull_dev *dev, void *buf, size_t len,
+			     loff_t pos, bool write)
+{
+	struct kvec kv = { .iov_base = buf, .iov_len = len };
+	struct iov_iter iter;
+	ssize_t ret;
+
+	iov_iter_kvec(&iter, write ? ITER_SOURCE : ITER_DEST, &kv, 1, len);
+
+	scull_lock(dev);
+	if (write) {
+		ret = scull_copy_from_iter(dev, &iter, pos);
+	} else {
+		ret = scull_copy_to_iter(dev, &iter, pos);
+	}
+	scull_unlock(dev);
+
+	return ret;
+}
+
+/*
+ * Check the memory counters against a walk of the qsets.
+ */
+static void scull_test_check_mem(struct kunit *test, struct scull_dev *dev)
+{
+	u64 quanta = 0, written = 0;
+	int items = 0;
+
+	for (struct scull_qset *dptr = dev->data; dptr; dptr = dptr->next) {
+		items++;
+		if (!dptr->data) {
+			continue;
+		}
+		KUNIT_EXPECT_NOT_NULL(test, dptr->gen);
+		for (int i = 0; i < dev->qset; i++) {
+			if (dptr->data[i]) {
+				quanta++;
+				written += dptr->gen[i] != 0;
+			}
+		}
+	}
+
+	KUNIT_EXPECT_EQ(test, dev->mem.quanta, quanta);
+	KUNIT_EXPECT_EQ(test, dev->mem.written, written);
+	KUNIT_EXPECT_EQ(test, dev->mem.data_bytes, quanta * dev->quantum);
+	KUNIT_EXPECT_LE(test, (loff_t)(items - 1) * dev->quantum * dev->qset,
+			(loff_t)dev->size);
+}
+
+/* Writes straddling quantum and qset boundaries read back as written */
+static void scull_test_boundaries(struct kunit *test)
+{
+	static const loff_t offsets[] = {
+		0,
+		SCULL_TEST_QUANTUM - 1,
+		SCULL_TEST_QUANTUM,
+		SCULL_TEST_QUANTUM + 1,
+		SCULL_TEST_ITEM - 1,
+		SCULL_TEST_ITEM,
+		SCULL_TEST_ITEM + 1,
+		3 * SCULL_TEST_ITEM - SCULL_TEST_QUANTUM / 2,
+	};
+	static const size_t lens[] = { 1, 2, SCULL_TEST_QUANTUM,
+				       SCULL_TEST_QUANTUM + 1,
+				       SCULL_TEST_ITEM + 3 };
+	struct scull_dev *dev = scull_test_dev(test);
+	u8 *shadow = kunit_kzalloc(test, SCULL_TEST_SIZE, GFP_KERNEL);
+	u8 *buf = kunit_kzalloc(test, SCULL_TEST_SIZE, GFP_KERNEL);
+	loff_t size = 0;
+
+	KUNIT_ASSERT_NOT_NULL(test, shadow);
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+
+	for (int i = 0; i < ARRAY_SIZE(offsets); i++) {
+		for (int j = 0; j < ARRAY_SIZE(lens); j++) {
+			loff_t pos = offsets[i];
+			size_t len = lens[j];
+
+			get_random_bytes(buf, len);
+			KUNIT_ASSERT_EQ(test,
+					scull_test_rw(dev, buf, len, pos, true),
+					(ssize_t)len);
+			memcpy(shadow + pos, buf, len);
+			size = max_t(loff_t, size, pos + len);
+			KUNIT_EXPECT_EQ(test, (loff_t)dev->size, size);
+		}
+	}
+
+	KUNIT_ASSERT_EQ(test, scull_test_rw(dev, buf, size, 0, false),
+			(ssize_t)size);
+	KUNIT_EXPECT_MEMEQ(test, buf, shadow, size);
+
+	/* reads are short at the end of the device, and empty past it */
+	KUNIT_EXPECT_EQ(test, scull_test_rw(dev, buf, 10, size - 1, false), 1);
+	KUNIT_EXPECT_EQ(test, scull_test_rw(dev, buf, 10, size, false), 0);
+
+	scull_test_check_mem(test, dev);
+}
+
+/* Holes read as zeros and have no memory */
+static void scull_test_holes(struct kunit *test)
+{
+	struct scull_dev *dev = scull_test_dev(test);
+	u8 *buf = kunit_kzalloc(test, SCULL_TEST_SIZE, GFP_KERNEL);
+	u8 one = 0xa5;
+
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+
+	KUNIT_ASSERT_EQ(test, scull_test_rw(dev, &one, 1, 0, true), 1);
+	KUNIT_ASSERT_EQ(test,
+			scull_test_rw(dev, &one, 1, SCULL_TEST_SIZE - 1, true),
+			1);
+	KUNIT_EXPECT_EQ(test, dev->mem.quanta, 2);
+	scull_test_check_mem(test, dev);
+
+	memset(buf, 0xff, SCULL_TEST_SIZE);
+	KUNIT_ASSERT_EQ(test,
+			scull_test_rw(dev, buf, SCULL_TEST_SIZE, 0, false),
+			SCULL_TEST_SIZE);
+	KUNIT_EXPECT_EQ(test, buf[0], one);
+	KUNIT_EXPECT_EQ(test, buf[SCULL_TEST_SIZE - 1], one);
+	for (int i = 1; i < SCULL_TEST_SIZE - 1; i++) {
+		KUNIT_ASSERT_EQ_MSG(test, buf[i], 0, "at %d", i);
+	}
+
+	/* punching whole quanta frees them */
+	scull_lock(dev);
+	KUNIT_EXPECT_EQ(test, scull_punch_hole(dev, 0, SCULL_TEST_SIZE), 0);
+	scull_unlock(dev);
+	KUNIT_EXPECT_EQ(test, dev->mem.quanta, 0);
+	KUNIT_EXPECT_EQ(test, (loff_t)dev->size, SCULL_TEST_SIZE);
+	scull_test_check_mem(test, dev);
+}
+
+/* scull_follow finds the nth qset of the list, with or without the hint */
+static void scull_test_follow(struct kunit *test)
+{
+	struct scull_dev *dev = scull_test_dev(test);
+	struct scull_qset *nodes[8];
+
+	scull_lock(dev);
+	for (int n = 0; n < ARRAY_SIZE(nodes); n++) {
+		nodes[n] = scull_follow(dev, n);
+		KUNIT_ASSERT_NOT_NULL(test, nodes[n]);
+	}
+	for (int n = ARRAY_SIZE(nodes) - 1; n >= 0; n--) {
+		KUNIT_EXPECT_PTR_EQ(test, scull_follow(dev, n), nodes[n]);
+	}
+	scull_unlock(dev);
+
+	struct scull_qset *dptr = dev->data;
+	for (int n = 0; n < ARRAY_SIZE(nodes); n++, dptr = dptr->next) {
+		KUNIT_ASSERT_PTR_EQ(test, dptr, nodes[n]);
+	}
+	KUNIT_EXPECT_NULL(test, dptr);
+}
+
+/* Trim frees everything and the device is usable again */
+static void scull_test_trim(struct kunit *test)
+{
+	struct scull_dev *dev = scull_test_dev(test);
+	u8 *buf = kunit_kzalloc(test, SCULL_TEST_SIZE, GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+
+	memset(buf, 0x3c, SCULL_TEST_SIZE);
+	KUNIT_ASSERT_EQ(test,
+			scull_test_rw(dev, buf, SCULL_TEST_SIZE, 0, true),
+			SCULL_TEST_SIZE);
+
+	scull_lock(dev);
+	scull_trim(dev);
+	scull_unlock(dev);
+
+	KUNIT_EXPECT_EQ(test, (loff_t)dev->size, 0);
+	KUNIT_EXPECT_NULL(test, dev->data);
+	KUNIT_EXPECT_NULL(test, dev->hint);
+	KUNIT_EXPECT_EQ(test, dev->mem.quanta, 0);
+	KUNIT_EXPECT_EQ(test, dev->mem.data_bytes, 0);
+	KUNIT_EXPECT_EQ(test, dev->mem.meta_bytes, 0);
+	KUNIT_EXPECT_EQ(test, dev->quantum, scull_quantum);
+	KUNIT_EXPECT_EQ(test, dev->qset, scull_qset);
+	KUNIT_EXPECT_EQ(test, scull_test_rw(dev, buf, 1, 0, false), 0);
+
+	KUNIT_ASSERT_EQ(test, scull_test_rw(dev, buf, 3, 5, true), 3);
+	KUNIT_EXPECT_EQ(test, (loff_t)dev->size, 8);
+	scull_test_check_mem(test, dev);
+}
+
+#define SCULL_TEST_THREADS 4
+#define SCULL_TEST_STRIPE 24 /* Not a multiple of the quantum */
+#define SCULL_TEST_ROUNDS 64
+
+struct scull_test_writer {
+	struct scull_dev *dev;
+	int index;
+	ssize_t err;
+	struct completion done;
+};
+
+static int scull_test_writer_fn(void *data)
+{
+	struct scull_test_writer *w = data;
+	u8 buf[SCULL_TEST_STRIPE];
+
+	memset(buf, w->index + 1, sizeof(buf));
+	for (int i = 0; i < SCULL_TEST_ROUNDS && !w->err; i++) {
+		loff_t pos = (loff_t)(i * SCULL_TEST_THREADS + w->index) *
+			     SCULL_TEST_STRIPE;
+		ssize_t ret = scull_test_rw(w->dev, buf, sizeof(buf), pos,
+					    true);
+
+		if (ret != sizeof(buf)) {
+			w->err = ret < 0 ? ret : -EIO;
+		}
+		cond_resched();
+	}
+
+	kthread_complete_and_exit(&w->done, 0);
+}
+
+/* Concurrent writers of interleaved stripes sharing quanta */
+static void scull_test_concurrent(struct kunit *test)
+{
+	const size_t size = (size_t)SCULL_TEST_THREADS * SCULL_TEST_ROUNDS *
+			    SCULL_TEST_STRIPE;
+	struct scull_dev *dev = scull_test_dev(test);
+	struct scull_test_writer w[SCULL_TEST_THREADS];
+	u8 *buf = kunit_kzalloc(test, size, GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+
+	for (int t = 0; t < SCULL_TEST_THREADS; t++) {
+		w[t].dev = dev;
+		w[t].index = t;
+		w[t].err = 0;
+		init_completion(&w[t].done);
+		struct task_struct *task = kthread_run(scull_test_writer_fn,
+						       &w[t], "scull_test/%d",
+						       t);
+		if (IS_ERR(task)) {
+			w[t].err = PTR_ERR(task);
+			complete(&w[t].done);
+		}
+	}
+	for (int t = 0; t < SCULL_TEST_THREADS; t++) {
+		wait_for_completion(&w[t].done);
+		KUNIT_EXPECT_EQ(test, w[t].err, 0);
+	}
+
+	KUNIT_EXPECT_EQ(test, (loff_t)dev->size, (loff_t)size);
+	KUNIT_ASSERT_EQ(test, scull_test_rw(dev, buf, size, 0, false),
+			(ssize_t)size);
+	for (size_t i = 0; i < size; i++) {
+		int t = (i / SCULL_TEST_STRIPE) % SCULL_TEST_THREADS;
+
+		KUNIT_ASSERT_EQ_MSG(test, buf[i], t + 1, "at %zu", i);
+	}
+	scull_test_check_mem(test, dev);
+}
+
+static struct kunit_case scull_engine_cases[] = {
+	KUNIT_CASE(scull_test_boundaries),
+	KUNIT_CASE(scull_test_holes),
+	KUNIT_CASE(scull_test_follow),
+	KUNIT_CASE(scull_test_trim),
+	KUNIT_CASE(scull_test_concurrent),
+	{}
+};
+
+static struct kunit_suite scull_engine_suite = {
+	.name = "scull_engine",
+	.test_cases = scull_engine_cases,
+};
+
+kunit_test_suite(scull_engine_suite);
@@ -0,0 +1,201 @@
+/*
+ * Tracepoints of the scull engine, under events/scull in tracefs.
+ * Devices are identified by their minor number and open files by the
+ * address of their struct file, so that tools/scullreplay can record a
+ * workload and issue it again.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scull
+
+#if !defined(_SCULL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCULL_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(scull_open,
+
+	TP_PROTO(int index, const void *file, unsigned int flags),
+
+	TP_ARGS(index, file, flags),
+
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(const void *, file)
+		__field(unsigned int, flags)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->file = file;
+		__entry->flags = flags;
+	),
+
+	TP_printk("dev=%d file=%p flags=%#x", __entry->index, __entry->file,
+		  __entry->flags)
+);
+
+TRACE_EVENT(scull_release,
+
+	TP_PROTO(int index, const void *file),
+
+	TP_ARGS(index, file),
+
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(const void *, file)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->file = file;
+	),
+
+	TP_printk("dev=%d file=%p", __entry->index, __entry->file)
+);
+
+/*
+ * Emitted when the operation completes: pos and count are the requested
+ * ones and ns is the time from the start of the operation.
+ */
+DECLARE_EVENT_CLASS(scull_rw,
+
+	TP_PROTO(int index, const void *file, loff_t pos, size_t count,
+		 ssize_t ret, u64 ns),
+
+	TP_ARGS(index, file, pos, count, ret, ns),
+
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(const void *, file)
+		__field(loff_t, pos)
+		__field(size_t, count)
+		__field(ssize_t, ret)
+		__field(u64, ns)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->file = file;
+		__entry->pos = pos;
+		__entry->count = count;
+		__entry->ret = ret;
+		__entry->ns = ns;
+	),
+
+	TP_printk("dev=%d file=%p pos=%lld count=%zu ret=%zd ns=%llu",
+		  __entry->index, __entry->file, __entry->pos, __entry->count,
+		  __entry->ret, __entry->ns)
+);
+
+DEFINE_EVENT(scull_rw, scull_read,
+	TP_PROTO(int index, const void *file, loff_t pos, size_t count,
+		 ssize_t ret, u64 ns),
+	TP_ARGS(index, file, pos, count, ret, ns)
+);
+
+DEFINE_EVENT(scull_rw, scull_write,
+	TP_PROTO(int index, const void *file, loff_t pos, size_t count,
+		 ssize_t ret, u64 ns),
+	TP_ARGS(index, file, pos, count, ret, ns)
+);
+
+TRACE_EVENT(scull_llseek,
+
+	TP_PROTO(int index, const void *file, loff_t off, int whence,
+		 loff_t ret),
+
+	TP_ARGS(index, file, off, whence, ret),
+
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(const void *, file)
+		__field(loff_t, off)
+		__field(int, whence)
+		__field(loff_t, ret)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->file = file;
+		__entry->off = off;
+		__entry->whence = whence;
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev=%d file=%p off=%lld whence=%d ret=%lld", __entry->index,
+		  __entry->file, __entry->off, __entry->whence, __entry->ret)
+);
+
+TRACE_EVENT(scull_trim,
+
+	TP_PROTO(int index, unsigned long size),
+
+	TP_ARGS(index, size),
+
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(unsigned long, size)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->size = size;
+	),
+
+	TP_printk("dev=%d size=%lu", __entry->index, __entry->size)
+);
+
+TRACE_EVENT(scull_follow,
+
+	TP_PROTO(int index, int item, int steps, bool found),
+
+	TP_ARGS(index, item, steps, found),
+
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(int, item)
+		__field(int, steps)
+		__field(bool, found)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->item = item;
+		__entry->steps = steps;
+		__entry->found = found;
+	),
+
+	TP_printk("dev=%d item=%d steps=%d found=%d", __entry->index,
+		  __entry->item, __entry->steps, __entry->found)
+);
+
+TRACE_EVENT(scull_alloc,
+
+	TP_PROTO(int index, size_t size, const void *ptr),
+
+	TP_ARGS(index, size, ptr),
+
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(size_t, size)
+		__field(const void *, ptr)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->size = size;
+		__entry->ptr = ptr;
+	),
+
+	TP_printk("dev=%d size=%zu ptr=%p", __entry->index, __entry->size,
+		  __entry->ptr)
+);
+
+#endif /* _SCULL_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE scull_trace
+#include <trace/define_trace.h>
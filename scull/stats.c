@@ -0,0 +1,277 @@
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+#include "scull.h"
+
+/*
+ * Operation counters.
+ * They are kept per CPU, so that counting does not bounce cache lines
+ * between CPUs, and are summed when read.
+ *
+ * A binary snapshot of the counters, memory footprint and latency
+ * histograms is refreshed every scull_stats_ms in a page that user space
+ * maps through the stats.bin debugfs file, so that sampling a device costs
+ * a few memory reads and no system call. The refresh only runs while the
+ * page is mapped; a read of stats.bin takes a snapshot of its own.
+ */
+
+static int scull_stats_ms = 1000;
+
+module_param(scull_stats_ms, int, S_IRUGO);
+
+void scull_stats_sum(struct scull_dev *dev, struct scull_stats *sum)
+{
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for_each_possible_cpu(cpu) {
+		struct scull_stats *s = per_cpu_ptr(dev->stats, cpu);
+
+		sum->reads += READ_ONCE(s->reads);
+		sum->writes += READ_ONCE(s->writes);
+		sum->read_bytes += READ_ONCE(s->read_bytes);
+		sum->write_bytes += READ_ONCE(s->write_bytes);
+		sum->trims += READ_ONCE(s->trims);
+		sum->allocs += READ_ONCE(s->allocs);
+		sum->alloc_fails += READ_ONCE(s->alloc_fails);
+		sum->migrations += READ_ONCE(s->migrations);
+		sum->reserve_quanta += READ_ONCE(s->reserve_quanta);
+		sum->reserve_meta += READ_ONCE(s->reserve_meta);
+		sum->reserve_empty += READ_ONCE(s->reserve_empty);
+		sum->lock_acquired += READ_ONCE(s->lock_acquired);
+		sum->lock_contended += READ_ONCE(s->lock_contended);
+		sum->lock_wait_ns += READ_ONCE(s->lock_wait_ns);
+		sum->lock_hold_ns += READ_ONCE(s->lock_hold_ns);
+	}
+}
+
+static int scull_stats_show(struct seq_file *s, void *v)
+{
+	struct scull_stats sum;
+
+	scull_stats_sum(s->private, &sum);
+
+	seq_printf(s, "reads %llu\n", sum.reads);
+	seq_printf(s, "writes %llu\n", sum.writes);
+	seq_printf(s, "read_bytes %llu\n", sum.read_bytes);
+	seq_printf(s, "write_bytes %llu\n", sum.write_bytes);
+	seq_printf(s, "trims %llu\n", sum.trims);
+	seq_printf(s, "allocs %llu\n", sum.allocs);
+	seq_printf(s, "alloc_fails %llu\n", sum.alloc_fails);
+	seq_printf(s, "migrations %llu\n", sum.migrations);
+	seq_printf(s, "reserve_quanta %llu\n", sum.reserve_quanta);
+	seq_printf(s, "reserve_meta %llu\n", sum.reserve_meta);
+	seq_printf(s, "reserve_empty %llu\n", sum.reserve_empty);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(scull_stats);
+
+/*
+ * Fill info with a snapshot of the device statistics, except seq.
+ * The lock is not taken, fields are read one at a time.
+ */
+int scull_stats_fill(struct scull_dev *dev, struct scull_stats_info *info)
+{
+	struct scull_latency *lat = kmalloc(sizeof(*lat), GFP_KERNEL);
+	struct scull_stats sum;
+
+	BUILD_BUG_ON(SCULL_STATS_LAT_NR != SCULL_LAT_NR);
+	BUILD_BUG_ON(SCULL_STATS_LAT_BUCKETS != SCULL_LAT_BUCKETS);
+	BUILD_BUG_ON(sizeof(*info) > PAGE_SIZE);
+
+	if (!lat) {
+		return -ENOMEM;
+	}
+
+	scull_stats_sum(dev, &sum);
+	scull_latency_sum(dev, lat);
+
+	info->version = SCULL_STATS_VERSION;
+	info->size = sizeof(*info);
+	info->time_ns = ktime_get_ns();
+	info->dev_size = READ_ONCE(dev->size);
+	info->quantum = READ_ONCE(dev->quantum);
+	info->qset = READ_ONCE(dev->qset);
+
+	info->reads = sum.reads;
+	info->writes = sum.writes;
+	info->read_bytes = sum.read_bytes;
+	info->write_bytes = sum.write_bytes;
+	info->trims = sum.trims;
+	info->allocs = sum.allocs;
+	info->alloc_fails = sum.alloc_fails;
+	info->lock_acquired = sum.lock_acquired;
+	info->lock_contended = sum.lock_contended;
+	info->lock_wait_ns = sum.lock_wait_ns;
+	info->lock_hold_ns = sum.lock_hold_ns;
+
+	info->data_bytes = READ_ONCE(dev->mem.data_bytes);
+	info->meta_bytes = READ_ONCE(dev->mem.meta_bytes);
+	info->quanta = READ_ONCE(dev->mem.quanta);
+	info->written = READ_ONCE(dev->mem.written);
+
+	memcpy(info->latency, lat->hist, sizeof(info->latency));
+
+	kfree(lat);
+	return 0;
+}
+
+/*
+ * Refresh the mapped page. The snapshot is taken aside, so that the page
+ * is odd only for the time of a copy.
+ */
+static void scull_stats_work(struct work_struct *work)
+{
+	struct scull_dev *dev =
+		container_of(to_delayed_work(work), struct scull_dev,
+			     stats_work);
+	struct scull_stats_info *page = dev->stats_page;
+	struct scull_stats_info *info = kzalloc(sizeof(*info), GFP_KERNEL);
+
+	if (info && !scull_stats_fill(dev, info)) {
+		u32 seq = page->seq;
+
+		WRITE_ONCE(page->seq, seq + 1);
+		smp_wmb();
+		info->seq = seq + 1;
+		memcpy(page, info, sizeof(*info));
+		smp_wmb();
+		WRITE_ONCE(page->seq, seq + 2);
+	}
+	kfree(info);
+
+	/* stops with the last mapping */
+	if (atomic_read(&dev->stats_maps)) {
+		queue_delayed_work(system_unbound_wq, &dev->stats_work,
+				   msecs_to_jiffies(scull_stats_ms));
+	}
+}
+
+/*
+ * Count a mapping of the page, starting its refresh with the first one.
+ */
+static void scull_stats_map(struct scull_dev *dev)
+{
+	if (atomic_inc_return(&dev->stats_maps) == 1) {
+		mod_delayed_work(system_unbound_wq, &dev->stats_work, 0);
+	}
+}
+
+static void scull_stats_vm_open(struct vm_area_struct *vma)
+{
+	scull_stats_map(vma->vm_private_data);
+}
+
+static void scull_stats_vm_close(struct vm_area_struct *vma)
+{
+	struct scull_dev *dev = vma->vm_private_data;
+
+	atomic_dec(&dev->stats_maps);
+}
+
+static const struct vm_operations_struct scull_stats_vm_ops = {
+	.open = scull_stats_vm_open,
+	.close = scull_stats_vm_close,
+};
+
+static ssize_t scull_stats_bin_read(struct file *file, char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	struct scull_dev *dev = file_inode(file)->i_private;
+	struct scull_stats_info *info = kzalloc(sizeof(*info), GFP_KERNEL);
+	ssize_t ret = -ENOMEM;
+
+	if (info && !scull_stats_fill(dev, info)) {
+		ret = simple_read_from_buffer(buf, count, ppos, info,
+					      sizeof(*info));
+	}
+	kfree(info);
+
+	return ret;
+}
+
+static int scull_stats_bin_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct scull_dev *dev = file_inode(file)->i_private;
+
+	if (vma->vm_pgoff || vma_pages(vma) != 1) {
+		return -EINVAL;
+	}
+	if (vma->vm_flags & VM_WRITE) {
+		return -EPERM;
+	}
+	vm_flags_clear(vma, VM_MAYWRITE);
+
+	int err = vm_insert_page(vma, vma->vm_start,
+				 virt_to_page(dev->stats_page));
+	if (err) {
+		return err;
+	}
+
+	vma->vm_ops = &scull_stats_vm_ops;
+	vma->vm_private_data = dev;
+	scull_stats_map(dev);
+	/* fresh as soon as it is mapped */
+	flush_delayed_work(&dev->stats_work);
+
+	return 0;
+}
+
+static const struct file_operations scull_stats_bin_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = scull_stats_bin_read,
+	.mmap = scull_stats_bin_mmap,
+	.llseek = default_llseek,
+};
+
+int scull_stats_init(struct scull_dev *dev)
+{
+	dev->stats = alloc_percpu(struct scull_stats);
+	if (!dev->stats) {
+		return -ENOMEM;
+	}
+
+	dev->stats_page = (void *)get_zeroed_page(GFP_KERNEL);
+	if (!dev->stats_page) {
+		free_percpu(dev->stats);
+		dev->stats = NULL;
+		return -ENOMEM;
+	}
+
+	if (scull_stats_ms < 10) {
+		scull_stats_ms = 10;
+	}
+
+	dev->stats_page->version = SCULL_STATS_VERSION;
+	dev->stats_page->size = sizeof(struct scull_stats_info);
+	INIT_DELAYED_WORK(&dev->stats_work, scull_stats_work);
+
+	debugfs_create_file("stats", 0444, dev->debugfs, dev,
+			    &scull_stats_fops);
+	/* not proxied, which would not forward mmap */
+	debugfs_create_file_unsafe("stats.bin", 0444, dev->debugfs, dev,
+				   &scull_stats_bin_fops);
+
+	return 0;
+}
+
+void scull_stats_cleanup(struct scull_dev *dev)
+{
+	if (dev->stats_page) {
+		cancel_delayed_work_sync(&dev->stats_work);
+		/* a mapping holds its own reference to the page */
+		free_page((unsigned long)dev->stats_page);
+		dev->stats_page = NULL;
+	}
+	free_percpu(dev->stats);
+	dev->stats = NULL;
+}
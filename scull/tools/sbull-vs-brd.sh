@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# fio comparison of sbull with brd.
+#
+# usage: sbull-vs-brd.sh [scull.ko] [size_mb] [seconds]
+#
+# Loads scull with one sbull disk and brd with one ram disk of the same
+# size, runs the same fio jobs on both, and prints one line per job and
+# disk with the read and write IOPS and bandwidth. Must run as root, with
+# neither module loaded.
+
+set -e
+
+ko=${1:-./scull.ko}
+size_mb=${2:-1024}
+seconds=${3:-30}
+jobs=$(nproc)
+
+insmod "$ko" scull_num_devs=1 sbull_size_mb="$size_mb"
+modprobe brd rd_nr=1 rd_size=$((size_mb * 1024))
+trap 'rmmod brd; rmmod scull' EXIT
+
+# name rw bs iodepth
+run() {
+	for disk in /dev/sbull0 /dev/ram0; do
+		fio --name="$1" --filename="$disk" --rw="$2" --bs="$3" \
+		    --iodepth="$4" --numjobs="$jobs" --ioengine=io_uring \
+		    --direct=1 --time_based --runtime="$seconds" \
+		    --size="${size_mb}M" --group_reporting --minimal |
+		awk -F';' -v disk="$disk" '{
+			printf "%-10s %-12s read %8d IOPS %8d KiB/s", $3, disk,
+			       $8, $7
+			printf "  write %8d IOPS %8d KiB/s\n", $49, $48
+		}'
+	done
+}
+
+# fill both disks, so that reads do not only see holes
+for disk in /dev/sbull0 /dev/ram0; do
+	dd if=/dev/urandom of="$disk" bs=1M count="$size_mb" \
+	   oflag=direct status=none
+done
+
+run randread randread 4k 32
+run randwrite randwrite 4k 32
+run randrw randrw 4k 32
+run seqread read 1M 8
+run seqwrite write 1M 8
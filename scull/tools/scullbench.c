@@ -0,0 +1,671 @@
+/*
+ * Throughput and latency benchmark of scull devices.
+ *
+ * usage: scullbench [options] /dev/scullN
+ *   -b size     block size (4K)
+ *   -s size     part of the device used (16M)
+ *   -p pattern  seq, rand or stride (seq)
+ *   -S blocks   stride of the stride pattern (16)
+ *   -w percent  writes in the mix (0)
+ *   -t threads  threads per process (1)
+ *   -P procs    processes (1)
+ *   -i iface    rw, prw, readv, uring or mmap (prw)
+ *   -d seconds  duration (5)
+ *   -N          open with O_DIRECT, for non-temporal copies
+ *   -c size     working set of the cache sensitive co-runner (none)
+ *   -H          print the CSV header first
+ * Sizes take a K, M or G suffix.
+ *
+ * The used part of the device is filled first, unless the mix is write
+ * only. Each thread opens the device and runs its own sequence of offsets;
+ * sequential ones start at evenly spaced offsets. The result is a CSV line
+ * with the throughput and the latency percentiles, taken from log-linear
+ * histograms with 16 buckets per power of two.
+ *
+ * The co-runner chases pointers through a random cycle over its working
+ * set, one cache line per step, alone for a second and then next to the
+ * benchmark. Its time per step in both cases tells how much the benchmark
+ * evicts it from the CPU caches, e.g. with and without -N.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+enum pattern { PAT_SEQ, PAT_RAND, PAT_STRIDE };
+enum iface { IF_RW, IF_PRW, IF_READV, IF_URING, IF_MMAP };
+
+static const char *const pattern_names[] = { "seq", "rand", "stride" };
+static const char *const iface_names[] = { "rw", "prw", "readv", "uring",
+					    "mmap" };
+
+struct opts {
+	const char *path;
+	size_t bs;
+	size_t size;
+	enum pattern pattern;
+	size_t stride;
+	int write_pct;
+	int threads;
+	int procs;
+	enum iface iface;
+	int seconds;
+	bool direct;
+	size_t co_size;
+	bool header;
+};
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct result {
+	uint64_t ops;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t hist[HIST_BUCKETS];
+};
+
+static struct opts opts = {
+	.bs = 4096,
+	.size = 16 << 20,
+	.pattern = PAT_SEQ,
+	.stride = 16,
+	.threads = 1,
+	.procs = 1,
+	.iface = IF_PRW,
+	.seconds = 5,
+};
+
+static struct result *results; /* One per thread, shared by processes */
+static uint64_t deadline_ns;
+
+struct line {
+	size_t next;
+	char pad[64 - sizeof(size_t)];
+};
+
+static struct line *co_lines;
+static size_t co_nr_lines;
+static volatile size_t co_sink;
+static double co_base_ns; /* Per step, alone */
+static double co_ns; /* Per step, next to the benchmark */
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int hist_bucket(uint64_t ns)
+{
+	if (ns < HIST_SUB) {
+		return ns;
+	}
+
+	int msb = 63 - __builtin_clzll(ns);
+	int sub = (ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1);
+
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+}
+
+/* Upper bound of a bucket */
+static uint64_t hist_value(int bucket)
+{
+	if (bucket < HIST_SUB) {
+		return bucket;
+	}
+
+	int msb = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+	int sub = bucket % HIST_SUB;
+
+	return (uint64_t)(HIST_SUB + sub + 1) << (msb - HIST_SUB_BITS);
+}
+
+static uint64_t hist_percentile(const uint64_t *hist, uint64_t total,
+				int permille)
+{
+	uint64_t rank = (total * permille + 999) / 1000;
+	uint64_t seen = 0;
+
+	for (int b = 0; b < HIST_BUCKETS; b++) {
+		seen += hist[b];
+		if (seen >= rank) {
+			return hist_value(b);
+		}
+	}
+	return UINT64_MAX;
+}
+
+static uint64_t xorshift64(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+static int co_init(void)
+{
+	uint64_t rand = 42;
+
+	co_nr_lines = opts.co_size / sizeof(struct line);
+	co_lines = aligned_alloc(64, co_nr_lines * sizeof(struct line));
+	if (!co_lines) {
+		return -1;
+	}
+
+	/* Sattolo's shuffle, for a single cycle through all lines */
+	for (size_t i = 0; i < co_nr_lines; i++) {
+		co_lines[i].next = i;
+	}
+	for (size_t i = co_nr_lines - 1; i > 0; i--) {
+		size_t j = xorshift64(&rand) % i;
+		size_t next = co_lines[i].next;
+
+		co_lines[i].next = co_lines[j].next;
+		co_lines[j].next = next;
+	}
+
+	return 0;
+}
+
+/* Chase pointers until the deadline, returns the time per step */
+static double co_chase(uint64_t until)
+{
+	uint64_t start = now_ns();
+	uint64_t steps = 0;
+	uint64_t now;
+	size_t i = 0;
+
+	do {
+		for (int k = 0; k < 1024; k++) {
+			i = co_lines[i].next;
+		}
+		steps += 1024;
+	} while ((now = now_ns()) < until);
+	co_sink = i;
+
+	return (double)(now - start) / steps;
+}
+
+static void *co_run(void *arg)
+{
+	co_ns = co_chase(deadline_ns);
+	return NULL;
+}
+
+/*
+ * Minimal io_uring, one request in flight, without liburing.
+ */
+
+struct uring {
+	int fd;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+};
+
+static int uring_init(struct uring *u)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(__NR_io_uring_setup, 4, &p);
+	if (u->fd < 0) {
+		return -1;
+	}
+
+	size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_len = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+	size_t sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	char *sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	char *cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+	u->sqes = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || u->sqes == MAP_FAILED) {
+		return -1;
+	}
+
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+}
+
+static ssize_t uring_rw(struct uring *u, int fd, bool wr, void *buf,
+			size_t len, off_t pos)
+{
+	unsigned tail = *u->sq_tail;
+	unsigned idx = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = wr ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = pos;
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	if (syscall(__NR_io_uring_enter, u->fd, 1, 1, IORING_ENTER_GETEVENTS,
+		    NULL, 0) < 0) {
+		return -1;
+	}
+
+	unsigned head = *u->cq_head;
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		errno = EIO;
+		return -1;
+	}
+	int res = u->cqes[head & *u->cq_mask].res;
+	__atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+
+	if (res < 0) {
+		errno = -res;
+		return -1;
+	}
+	return res;
+}
+
+/*
+ * Workers
+ */
+
+struct worker {
+	int id;
+	int fd;
+	char *buf;
+	char *map; /* mmap interface */
+	off_t cur; /* File position, rw interface */
+	struct uring uring;
+	uint64_t rand;
+};
+
+static ssize_t do_io(struct worker *w, bool wr, off_t pos)
+{
+	size_t bs = opts.bs;
+
+	switch (opts.iface) {
+	case IF_RW: {
+		if (w->cur != pos && lseek(w->fd, pos, SEEK_SET) < 0) {
+			return -1;
+		}
+		ssize_t ret = wr ? write(w->fd, w->buf, bs) :
+				      read(w->fd, w->buf, bs);
+		w->cur = ret > 0 ? pos + ret : -1;
+		return ret;
+	}
+	case IF_PRW:
+		return wr ? pwrite(w->fd, w->buf, bs, pos) :
+			       pread(w->fd, w->buf, bs, pos);
+	case IF_READV: {
+		struct iovec iov[4];
+
+		for (int i = 0; i < 4; i++) {
+			iov[i].iov_base = w->buf + i * bs / 4;
+			iov[i].iov_len = i < 3 ? bs / 4 : bs - 3 * (bs / 4);
+		}
+		return wr ? pwritev(w->fd, iov, 4, pos) :
+			       preadv(w->fd, iov, 4, pos);
+	}
+	case IF_URING:
+		return uring_rw(&w->uring, w->fd, wr, w->buf, bs, pos);
+	case IF_MMAP:
+		if (wr) {
+			memcpy(w->map + pos, w->buf, bs);
+		} else {
+			memcpy(w->buf, w->map + pos, bs);
+		}
+		return bs;
+	}
+	return -1;
+}
+
+static void *worker_run(void *arg)
+{
+	struct worker *w = arg;
+	struct result *res = &results[w->id];
+	size_t blocks = opts.size / opts.bs;
+	int nr_workers = opts.procs * opts.threads;
+	size_t block = blocks * w->id / nr_workers;
+	size_t lap = 0;
+
+	while (now_ns() < deadline_ns) {
+		bool wr = (int)(xorshift64(&w->rand) % 100) < opts.write_pct;
+		off_t pos = (off_t)block * opts.bs;
+
+		uint64_t start = now_ns();
+		ssize_t ret = do_io(w, wr, pos);
+		uint64_t ns = now_ns() - start;
+
+		if (ret != (ssize_t)opts.bs) {
+			res->errors++;
+		} else {
+			res->ops++;
+			res->bytes += ret;
+			res->hist[hist_bucket(ns)]++;
+		}
+
+		switch (opts.pattern) {
+		case PAT_SEQ:
+			block = (block + 1) % blocks;
+			break;
+		case PAT_RAND:
+			block = xorshift64(&w->rand) % blocks;
+			break;
+		case PAT_STRIDE:
+			block += opts.stride;
+			if (block >= blocks) {
+				/* next lap starts one block further */
+				block = ++lap % opts.stride % blocks;
+			}
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static int worker_init(struct worker *w, int id)
+{
+	w->id = id;
+	w->cur = 0;
+	w->rand = 0x9e3779b97f4a7c15ull * (id + 1);
+	w->buf = aligned_alloc(4096, (opts.bs + 4095) / 4096 * 4096);
+	if (!w->buf) {
+		return -1;
+	}
+	memset(w->buf, 0x5a, opts.bs);
+
+	w->fd = open(opts.path, O_RDWR | (opts.direct ? O_DIRECT : 0));
+	if (w->fd < 0) {
+		perror(opts.path);
+		return -1;
+	}
+
+	if (opts.iface == IF_URING && uring_init(&w->uring)) {
+		perror("io_uring");
+		return -1;
+	}
+	if (opts.iface == IF_MMAP) {
+		w->map = mmap(NULL, opts.size, PROT_READ | PROT_WRITE,
+			      MAP_SHARED, w->fd, 0);
+		if (w->map == MAP_FAILED) {
+			perror("mmap");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Run the threads of process proc */
+static int run_process(int proc)
+{
+	struct worker *workers = calloc(opts.threads, sizeof(*workers));
+	pthread_t *tids = calloc(opts.threads, sizeof(*tids));
+
+	if (!workers || !tids) {
+		return -1;
+	}
+
+	for (int i = 0; i < opts.threads; i++) {
+		if (worker_init(&workers[i], proc * opts.threads + i)) {
+			return -1;
+		}
+	}
+	for (int i = 0; i < opts.threads; i++) {
+		if (pthread_create(&tids[i], NULL, worker_run, &workers[i])) {
+			return -1;
+		}
+	}
+	for (int i = 0; i < opts.threads; i++) {
+		pthread_join(tids[i], NULL);
+	}
+
+	return 0;
+}
+
+/* Write the used part of the device, so that reads do not hit its end */
+static int prefill(void)
+{
+	size_t len = 1 << 20;
+	char *buf = malloc(len);
+	int fd = open(opts.path, O_RDWR);
+
+	if (!buf || fd < 0) {
+		perror(opts.path);
+		return -1;
+	}
+	memset(buf, 0xa5, len);
+
+	for (size_t pos = 0; pos < opts.size; pos += len) {
+		size_t n = opts.size - pos < len ? opts.size - pos : len;
+
+		if (pwrite(fd, buf, n, pos) != (ssize_t)n) {
+			perror("prefill");
+			return -1;
+		}
+	}
+
+	close(fd);
+	free(buf);
+	return 0;
+}
+
+static size_t parse_size(const char *s)
+{
+	char *end;
+	size_t n = strtoull(s, &end, 0);
+
+	switch (*end) {
+	case 'G':
+	case 'g':
+		n <<= 10;
+		/* fall through */
+	case 'M':
+	case 'm':
+		n <<= 10;
+		/* fall through */
+	case 'K':
+	case 'k':
+		n <<= 10;
+	}
+	return n;
+}
+
+static int parse_name(const char *s, const char *const *names, int nr)
+{
+	for (int i = 0; i < nr; i++) {
+		if (!strcmp(s, names[i])) {
+			return i;
+		}
+	}
+	fprintf(stderr, "unknown name: %s\n", s);
+	exit(2);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: scullbench [-b size] [-s size] [-p seq|rand|stride] [-S blocks]\n"
+		"                  [-w percent] [-t threads] [-P procs]\n"
+		"                  [-i rw|prw|readv|uring|mmap] [-d seconds] [-N]\n"
+		"                  [-c size] [-H] device\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "b:s:p:S:w:t:P:i:d:Nc:H")) != -1) {
+		switch (c) {
+		case 'b':
+			opts.bs = parse_size(optarg);
+			break;
+		case 's':
+			opts.size = parse_size(optarg);
+			break;
+		case 'p':
+			opts.pattern = parse_name(optarg, pattern_names, 3);
+			break;
+		case 'S':
+			opts.stride = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			opts.write_pct = atoi(optarg);
+			break;
+		case 't':
+			opts.threads = atoi(optarg);
+			break;
+		case 'P':
+			opts.procs = atoi(optarg);
+			break;
+		case 'i':
+			opts.iface = parse_name(optarg, iface_names, 5);
+			break;
+		case 'd':
+			opts.seconds = atoi(optarg);
+			break;
+		case 'N':
+			opts.direct = true;
+			break;
+		case 'c':
+			opts.co_size = parse_size(optarg);
+			break;
+		case 'H':
+			opts.header = true;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1) {
+		usage();
+	}
+	opts.path = argv[optind];
+
+	if (!opts.bs || opts.size < opts.bs || !opts.stride ||
+	    opts.threads < 1 || opts.procs < 1 || opts.seconds < 1 ||
+	    (opts.co_size && opts.co_size < sizeof(struct line))) {
+		usage();
+	}
+
+	if (opts.write_pct < 100 && prefill()) {
+		return 1;
+	}
+
+	if (opts.co_size) {
+		if (co_init()) {
+			perror("co-runner");
+			return 1;
+		}
+		co_base_ns = co_chase(now_ns() + 1000000000ull);
+	}
+
+	int nr_workers = opts.procs * opts.threads;
+	results = mmap(NULL, nr_workers * sizeof(*results),
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1,
+		       0);
+	if (results == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	deadline_ns = now_ns() + opts.seconds * 1000000000ull;
+
+	for (int p = 1; p < opts.procs; p++) {
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (!pid) {
+			_exit(run_process(p) ? 1 : 0);
+		}
+	}
+	pthread_t co_thread;
+	if (opts.co_size && pthread_create(&co_thread, NULL, co_run, NULL)) {
+		return 1;
+	}
+	int err = run_process(0);
+	if (opts.co_size) {
+		pthread_join(co_thread, NULL);
+	}
+	for (int status; wait(&status) > 0;) {
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			err = -1;
+		}
+	}
+	if (err) {
+		return 1;
+	}
+
+	struct result total;
+
+	memset(&total, 0, sizeof(total));
+	for (int i = 0; i < nr_workers; i++) {
+		total.ops += results[i].ops;
+		total.bytes += results[i].bytes;
+		total.errors += results[i].errors;
+		for (int b = 0; b < HIST_BUCKETS; b++) {
+			total.hist[b] += results[i].hist[b];
+		}
+	}
+
+	if (opts.header) {
+		printf("iface,pattern,block_size,write_pct,threads,procs,"
+		       "seconds,ops,errors,mb_per_s,iops,p50_ns,p99_ns,"
+		       "p999_ns,direct,co_size,co_base_ns,co_ns\n");
+	}
+	printf("%s,%s,%zu,%d,%d,%d,%d,%llu,%llu,%.1f,%.0f,%llu,%llu,%llu,"
+	       "%d,%zu,%.2f,%.2f\n",
+	       iface_names[opts.iface], pattern_names[opts.pattern], opts.bs,
+	       opts.write_pct, opts.threads, opts.procs, opts.seconds,
+	       (unsigned long long)total.ops,
+	       (unsigned long long)total.errors,
+	       total.bytes / 1e6 / opts.seconds,
+	       (double)total.ops / opts.seconds,
+	       (unsigned long long)hist_percentile(total.hist, total.ops, 500),
+	       (unsigned long long)hist_percentile(total.hist, total.ops, 990),
+	       (unsigned long long)hist_percentile(total.hist, total.ops, 999),
+	       opts.direct, opts.co_size, co_base_ns, co_ns);
+
+	return 0;
+}
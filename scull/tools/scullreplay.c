@@ -0,0 +1,722 @@
+/*
+ * Record and replay of scull workloads.
+ *
+ * usage: scullreplay record [-T tracefs] [-d seconds] trace
+ *        scullreplay replay [-s speed] [-p path] trace
+ *
+ * record enables the scull tracepoints and converts the events read from
+ * trace_pipe into a trace file, one operation per line:
+ *   time_ns tid file op dev arg1 arg2 ret ns
+ * where op is open (arg1 is the flags), release, read or write (arg1 is
+ * the position, arg2 the count) or llseek (arg1 is the offset, arg2
+ * whence), and ns is the duration of reads and writes. Recording stops
+ * after the given duration, or on SIGINT.
+ *
+ * replay issues the operations of each recorded thread from a thread of
+ * its own, at the recorded times divided by speed (1), or back to back if
+ * speed is 0. Devices are opened through the path pattern (/dev/scull%d).
+ * Reads and writes are issued at their recorded position, and files opened
+ * before the recording started are opened read-write on first use.
+ * It reports per operation the recorded and replayed latency percentiles,
+ * the operations whose result differs from the recorded one, and how late
+ * operations were issued.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+enum op_type { OP_OPEN, OP_RELEASE, OP_READ, OP_WRITE, OP_LLSEEK, OP_NR };
+
+static const char *const op_names[OP_NR] = { "open", "release", "read",
+					     "write", "llseek" };
+
+static const char *const events[OP_NR] = { "scull_open", "scull_release",
+					   "scull_read", "scull_write",
+					   "scull_llseek" };
+
+struct op {
+	uint64_t time; /* Completion time, in the trace clock */
+	uint64_t file;
+	int64_t arg1;
+	int64_t arg2;
+	int64_t ret;
+	uint64_t ns;
+	int tid;
+	int dev;
+	enum op_type type;
+};
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct result {
+	uint64_t ops[OP_NR];
+	uint64_t diverged[OP_NR];
+	uint64_t recorded[OP_NR][HIST_BUCKETS];
+	uint64_t replayed[OP_NR][HIST_BUCKETS];
+	uint64_t lag[HIST_BUCKETS];
+	uint64_t max_lag;
+};
+
+struct thread {
+	pthread_t thread;
+	int tid;
+	struct op **ops;
+	size_t nr_ops;
+	struct result result;
+};
+
+struct open_file {
+	uint64_t file;
+	int fd;
+};
+
+static const char *tracefs = "/sys/kernel/tracing";
+static const char *path = "/dev/scull%d";
+static double speed = 1;
+static int seconds;
+
+static volatile sig_atomic_t stop;
+
+static uint64_t start_ns; /* Replay start */
+static uint64_t first_ns; /* Issue time of the first operation */
+
+static struct open_file *files;
+static size_t nr_files;
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int hist_bucket(uint64_t ns)
+{
+	if (ns < HIST_SUB) {
+		return ns;
+	}
+
+	int msb = 63 - __builtin_clzll(ns);
+	int sub = (ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1);
+
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+}
+
+/* Upper bound of a bucket */
+static uint64_t hist_value(int bucket)
+{
+	if (bucket < HIST_SUB) {
+		return bucket;
+	}
+
+	int msb = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+	int sub = bucket % HIST_SUB;
+
+	return (uint64_t)(HIST_SUB + sub + 1) << (msb - HIST_SUB_BITS);
+}
+
+static uint64_t hist_percentile(const uint64_t *hist, uint64_t total,
+				int permille)
+{
+	uint64_t rank = (total * permille + 999) / 1000;
+	uint64_t seen = 0;
+
+	if (!total) {
+		return 0;
+	}
+	for (int b = 0; b < HIST_BUCKETS; b++) {
+		seen += hist[b];
+		if (seen >= rank) {
+			return hist_value(b);
+		}
+	}
+	return UINT64_MAX;
+}
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static int enable_events(const char *value)
+{
+	char name[512];
+	int err = 0;
+
+	for (int i = 0; i < OP_NR; i++) {
+		snprintf(name, sizeof(name), "%s/events/scull/%s/enable",
+			 tracefs, events[i]);
+		FILE *f = fopen(name, "w");
+
+		if (!f || fputs(value, f) < 0 || fclose(f)) {
+			perror(name);
+			err = -1;
+		}
+	}
+	return err;
+}
+
+/*
+ * Parse a trace_pipe line such as
+ *   scullbench-1234    [003] ..... 12345.678901: scull_read: dev=0 ...
+ * The command may hold spaces and dashes, so the line is parsed backwards
+ * from the event name.
+ */
+static int parse_event(char *line, struct op *op)
+{
+	char *name = strstr(line, ": scull_");
+
+	if (!name) {
+		return -1;
+	}
+	*name = '\0';
+	name += 2;
+
+	char *ts = strrchr(line, ' ');
+	char *cpu = strrchr(line, '[');
+	if (!ts || !cpu || cpu == line) {
+		return -1;
+	}
+
+	unsigned long long sec, usec;
+	if (sscanf(ts + 1, "%llu.%llu", &sec, &usec) != 2) {
+		return -1;
+	}
+	op->time = sec * 1000000000ull + usec * 1000;
+
+	char *p = cpu - 1;
+	while (p > line && *p == ' ') {
+		p--;
+	}
+	while (p > line && p[-1] >= '0' && p[-1] <= '9') {
+		p--;
+	}
+	if (p == line || p[-1] != '-') {
+		return -1;
+	}
+	op->tid = atoi(p);
+
+	char *args = strchr(name, ':');
+	if (!args) {
+		return -1;
+	}
+	*args++ = '\0';
+
+	int type;
+	for (type = 0; type < OP_NR; type++) {
+		if (!strcmp(name, events[type])) {
+			break;
+		}
+	}
+	op->type = type;
+	op->arg1 = op->arg2 = op->ret = 0;
+	op->ns = 0;
+
+	unsigned long long file, ns;
+	long long arg1, arg2, ret;
+	unsigned int flags;
+	int whence;
+
+	switch (type) {
+	case OP_OPEN:
+		if (sscanf(args, " dev=%d file=%llx flags=%x", &op->dev, &file,
+			   &flags) != 3) {
+			return -1;
+		}
+		op->arg1 = flags;
+		break;
+	case OP_RELEASE:
+		if (sscanf(args, " dev=%d file=%llx", &op->dev, &file) != 2) {
+			return -1;
+		}
+		break;
+	case OP_READ:
+	case OP_WRITE:
+		if (sscanf(args,
+			   " dev=%d file=%llx pos=%lld count=%lld ret=%lld ns=%llu",
+			   &op->dev, &file, &arg1, &arg2, &ret, &ns) != 6) {
+			return -1;
+		}
+		op->arg1 = arg1;
+		op->arg2 = arg2;
+		op->ret = ret;
+		op->ns = ns;
+		break;
+	case OP_LLSEEK:
+		if (sscanf(args, " dev=%d file=%llx off=%lld whence=%d ret=%lld",
+			   &op->dev, &file, &arg1, &whence, &ret) != 5) {
+			return -1;
+		}
+		op->arg1 = arg1;
+		op->arg2 = whence;
+		op->ret = ret;
+		break;
+	default:
+		return -1;
+	}
+	op->file = file;
+
+	return 0;
+}
+
+static void write_op(FILE *out, const struct op *op)
+{
+	fprintf(out, "%llu %d %llx %s %d %lld %lld %lld %llu\n",
+		(unsigned long long)op->time, op->tid,
+		(unsigned long long)op->file, op_names[op->type], op->dev,
+		(long long)op->arg1, (long long)op->arg2, (long long)op->ret,
+		(unsigned long long)op->ns);
+}
+
+static int record(const char *trace)
+{
+	char name[512];
+	static char buf[1 << 16];
+	size_t len = 0;
+	uint64_t nr = 0;
+
+	FILE *out = fopen(trace, "w");
+	if (!out) {
+		perror(trace);
+		return 1;
+	}
+
+	snprintf(name, sizeof(name), "%s/trace_pipe", tracefs);
+	int fd = open(name, O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		perror(name);
+		return 1;
+	}
+
+	struct sigaction sa = { .sa_handler = on_signal };
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (enable_events("1")) {
+		enable_events("0");
+		return 1;
+	}
+
+	uint64_t deadline = seconds ? now_ns() + seconds * 1000000000ull : 0;
+
+	while (!stop && (!deadline || now_ns() < deadline)) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+		if (poll(&pfd, 1, 100) <= 0) {
+			continue;
+		}
+		ssize_t n = read(fd, buf + len, sizeof(buf) - len - 1);
+		if (n <= 0) {
+			continue;
+		}
+		len += n;
+		buf[len] = '\0';
+
+		char *line = buf;
+		for (char *eol; (eol = strchr(line, '\n')); line = eol + 1) {
+			struct op op;
+
+			*eol = '\0';
+			if (!parse_event(line, &op)) {
+				write_op(out, &op);
+				nr++;
+			}
+		}
+		len -= line - buf;
+		memmove(buf, line, len);
+		if (len == sizeof(buf) - 1) {
+			len = 0; /* not a trace line */
+		}
+	}
+
+	int err = enable_events("0");
+	close(fd);
+	if (fclose(out)) {
+		perror(trace);
+		err = -1;
+	}
+	fprintf(stderr, "%llu operations recorded\n", (unsigned long long)nr);
+
+	return err ? 1 : 0;
+}
+
+static struct op *load(const char *trace, size_t *nr)
+{
+	FILE *in = fopen(trace, "r");
+	struct op *ops = NULL;
+	size_t size = 0;
+	char line[256];
+
+	if (!in) {
+		perror(trace);
+		return NULL;
+	}
+
+	*nr = 0;
+	while (fgets(line, sizeof(line), in)) {
+		unsigned long long time, file, ns;
+		long long arg1, arg2, ret;
+		char name[16];
+		struct op op;
+
+		if (sscanf(line, "%llu %d %llx %15s %d %lld %lld %lld %llu",
+			   &time, &op.tid, &file, name, &op.dev, &arg1, &arg2,
+			   &ret, &ns) != 9) {
+			fprintf(stderr, "%s: bad line: %s", trace, line);
+			continue;
+		}
+		for (op.type = 0; op.type < OP_NR; op.type++) {
+			if (!strcmp(name, op_names[op.type])) {
+				break;
+			}
+		}
+		if (op.type == OP_NR) {
+			fprintf(stderr, "%s: bad operation: %s\n", trace, name);
+			continue;
+		}
+		op.time = time;
+		op.file = file;
+		op.arg1 = arg1;
+		op.arg2 = arg2;
+		op.ret = ret;
+		op.ns = ns;
+
+		if (*nr == size) {
+			size = size ? 2 * size : 1024;
+			ops = realloc(ops, size * sizeof(*ops));
+			if (!ops) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		ops[(*nr)++] = op;
+	}
+	fclose(in);
+
+	return ops;
+}
+
+/* Time the operation was issued at, in the trace clock */
+static uint64_t issue_time(const struct op *op)
+{
+	return op->time - op->ns;
+}
+
+/*
+ * Descriptor of a recorded file, opened on first use if its open was not
+ * recorded.
+ */
+static int file_fd(const struct op *op)
+{
+	char name[256];
+	int fd = -1;
+
+	pthread_mutex_lock(&files_lock);
+	for (size_t i = 0; i < nr_files; i++) {
+		if (files[i].file == op->file) {
+			fd = files[i].fd;
+			if (op->type == OP_RELEASE) {
+				files[i] = files[--nr_files];
+			}
+			goto out;
+		}
+	}
+	if (op->type == OP_RELEASE) {
+		goto out;
+	}
+
+	int flags = O_RDWR;
+	if (op->type == OP_OPEN) {
+		flags = op->arg1 & (O_ACCMODE | O_APPEND | O_NONBLOCK);
+	}
+	snprintf(name, sizeof(name), path, op->dev);
+	fd = open(name, flags);
+	if (fd < 0) {
+		perror(name);
+		goto out;
+	}
+
+	struct open_file *more =
+		realloc(files, (nr_files + 1) * sizeof(*files));
+	if (!more) {
+		perror("realloc");
+		exit(1);
+	}
+	files = more;
+	files[nr_files].file = op->file;
+	files[nr_files].fd = fd;
+	nr_files++;
+out:
+	pthread_mutex_unlock(&files_lock);
+	return fd;
+}
+
+static int64_t replay_op(const struct op *op, char **buf, size_t *buf_size)
+{
+	int fd = file_fd(op);
+
+	if (fd < 0) {
+		return op->type == OP_RELEASE ? 0 : -errno;
+	}
+
+	size_t count = op->arg2;
+	if ((op->type == OP_READ || op->type == OP_WRITE) &&
+	    count > *buf_size) {
+		free(*buf);
+		*buf = malloc(count);
+		if (!*buf) {
+			perror("malloc");
+			exit(1);
+		}
+		memset(*buf, 0x5a, count);
+		*buf_size = count;
+	}
+
+	int64_t ret;
+
+	switch (op->type) {
+	case OP_OPEN:
+		return 0;
+	case OP_RELEASE:
+		return close(fd) ? -errno : 0;
+	case OP_READ:
+		ret = pread(fd, *buf, count, op->arg1);
+		break;
+	case OP_WRITE:
+		ret = pwrite(fd, *buf, count, op->arg1);
+		break;
+	case OP_LLSEEK:
+		ret = lseek(fd, op->arg1, op->arg2);
+		break;
+	default:
+		return -EINVAL;
+	}
+	return ret < 0 ? -errno : ret;
+}
+
+static void *thread_run(void *arg)
+{
+	struct thread *t = arg;
+	struct result *r = &t->result;
+	char *buf = NULL;
+	size_t buf_size = 0;
+
+	for (size_t i = 0; i < t->nr_ops; i++) {
+		const struct op *op = t->ops[i];
+
+		if (speed > 0) {
+			uint64_t target = start_ns + (issue_time(op) - first_ns) /
+							     speed;
+			struct timespec ts = {
+				.tv_sec = target / 1000000000ull,
+				.tv_nsec = target % 1000000000ull,
+			};
+
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					       &ts, NULL) == EINTR) {
+			}
+
+			uint64_t lag = now_ns() - target;
+			r->lag[hist_bucket(lag)]++;
+			if (lag > r->max_lag) {
+				r->max_lag = lag;
+			}
+		}
+
+		uint64_t start = now_ns();
+		int64_t ret = replay_op(op, &buf, &buf_size);
+		uint64_t ns = now_ns() - start;
+
+		r->ops[op->type]++;
+		r->diverged[op->type] += ret != op->ret;
+		r->recorded[op->type][hist_bucket(op->ns)]++;
+		r->replayed[op->type][hist_bucket(ns)]++;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static int replay(const char *trace)
+{
+	size_t nr_ops;
+	struct op *ops = load(trace, &nr_ops);
+
+	if (!ops) {
+		return 1;
+	}
+	if (!nr_ops) {
+		fprintf(stderr, "%s: no operations\n", trace);
+		return 1;
+	}
+
+	struct thread *threads = NULL;
+	size_t nr_threads = 0;
+
+	first_ns = issue_time(&ops[0]);
+	for (size_t i = 0; i < nr_ops; i++) {
+		struct thread *t = NULL;
+
+		if (issue_time(&ops[i]) < first_ns) {
+			first_ns = issue_time(&ops[i]);
+		}
+		for (size_t j = 0; j < nr_threads; j++) {
+			if (threads[j].tid == ops[i].tid) {
+				t = &threads[j];
+				break;
+			}
+		}
+		if (!t) {
+			threads = realloc(threads,
+					  (nr_threads + 1) * sizeof(*threads));
+			if (!threads) {
+				perror("realloc");
+				return 1;
+			}
+			t = &threads[nr_threads++];
+			memset(t, 0, sizeof(*t));
+			t->tid = ops[i].tid;
+		}
+		t->ops = realloc(t->ops, (t->nr_ops + 1) * sizeof(*t->ops));
+		if (!t->ops) {
+			perror("realloc");
+			return 1;
+		}
+		t->ops[t->nr_ops++] = &ops[i];
+	}
+
+	start_ns = now_ns();
+	if (speed > 0) {
+		start_ns += 10000000; /* let all threads start */
+	}
+	for (size_t i = 0; i < nr_threads; i++) {
+		int err = pthread_create(&threads[i].thread, NULL, thread_run,
+					 &threads[i]);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			return 1;
+		}
+	}
+
+	static struct result total;
+
+	for (size_t i = 0; i < nr_threads; i++) {
+		struct result *r = &threads[i].result;
+
+		pthread_join(threads[i].thread, NULL);
+		for (int t = 0; t < OP_NR; t++) {
+			total.ops[t] += r->ops[t];
+			total.diverged[t] += r->diverged[t];
+			for (int b = 0; b < HIST_BUCKETS; b++) {
+				total.recorded[t][b] += r->recorded[t][b];
+				total.replayed[t][b] += r->replayed[t][b];
+			}
+		}
+		for (int b = 0; b < HIST_BUCKETS; b++) {
+			total.lag[b] += r->lag[b];
+		}
+		if (r->max_lag > total.max_lag) {
+			total.max_lag = r->max_lag;
+		}
+	}
+	double elapsed = (now_ns() - start_ns) / 1e9;
+
+	printf("%zu operations, %zu threads, %.3f s\n", nr_ops, nr_threads,
+	       elapsed);
+	printf("%-8s %10s %9s %12s %12s %12s %12s\n", "op", "count",
+	       "diverged", "rec_p50_ns", "rec_p99_ns", "p50_ns", "p99_ns");
+	for (int t = 0; t < OP_NR; t++) {
+		if (!total.ops[t]) {
+			continue;
+		}
+		printf("%-8s %10llu %9llu", op_names[t],
+		       (unsigned long long)total.ops[t],
+		       (unsigned long long)total.diverged[t]);
+		if (t == OP_READ || t == OP_WRITE) {
+			printf(" %12llu %12llu",
+			       (unsigned long long)hist_percentile(
+				       total.recorded[t], total.ops[t], 500),
+			       (unsigned long long)hist_percentile(
+				       total.recorded[t], total.ops[t], 990));
+		} else {
+			printf(" %12s %12s", "-", "-");
+		}
+		printf(" %12llu %12llu\n",
+		       (unsigned long long)hist_percentile(total.replayed[t],
+							   total.ops[t], 500),
+		       (unsigned long long)hist_percentile(total.replayed[t],
+							   total.ops[t], 990));
+	}
+	if (speed > 0) {
+		printf("lag p50 %llu ns, p99 %llu ns, max %llu ns\n",
+		       (unsigned long long)hist_percentile(total.lag, nr_ops,
+							   500),
+		       (unsigned long long)hist_percentile(total.lag, nr_ops,
+							   990),
+		       (unsigned long long)total.max_lag);
+	}
+
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: scullreplay record [-T tracefs] [-d seconds] trace\n"
+		"       scullreplay replay [-s speed] [-p path] trace\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int c;
+
+	if (argc < 2) {
+		usage();
+	}
+	bool rec = !strcmp(argv[1], "record");
+	if (!rec && strcmp(argv[1], "replay")) {
+		usage();
+	}
+	optind = 2;
+
+	while ((c = getopt(argc, argv, rec ? "T:d:" : "s:p:")) != -1) {
+		switch (c) {
+		case 'T':
+			tracefs = optarg;
+			break;
+		case 'd':
+			seconds = atoi(optarg);
+			break;
+		case 's':
+			speed = atof(optarg);
+			break;
+		case 'p':
+			path = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1 || seconds < 0 || speed < 0) {
+		usage();
+	}
+
+	return rec ? record(argv[optind]) : replay(argv[optind]);
+}
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../scull.h"
+
+/*
+ * Microbenchmarks of the storage engine in userspace, to be run under perf.
+ *
+ * usage: bench [-q quantum] [-Q qset] [size_mb...]
+ *
+ * For each device size, reports the time per operation of:
+ *   write   sequential writes of CHUNK bytes
+ *   read    sequential reads of CHUNK bytes
+ *   rread   reads of a quantum at a random offset
+ *   lookup  scull_follow of a random item
+ *   trim    scull_trim of the whole device, per quantum freed
+ */
+
+#define CHUNK (64 * 1024)
+#define RANDOM_OPS 1000000
+
+static u64 rand_state = 88172645463325252ull;
+
+static u64 xorshift64(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 7;
+	rand_state ^= rand_state << 17;
+	return rand_state;
+}
+
+static void report(int size_mb, const char *op, u64 ns, u64 ops)
+{
+	printf("%4d MiB %-6s %10.1f ns/op (%llu ops)\n", size_mb, op,
+	       (double)ns / ops, (unsigned long long)ops);
+}
+
+static ssize_t transfer(struct scull_dev *dev, void *buf, size_t len,
+			loff_t pos, bool write)
+{
+	struct kvec kv = { .iov_base = buf, .iov_len = len };
+	struct iov_iter iter;
+
+	iov_iter_kvec(&iter, write ? ITER_SOURCE : ITER_DEST, &kv, 1, len);
+	return write ? scull_copy_from_iter(dev, &iter, pos) :
+		       scull_copy_to_iter(dev, &iter, pos);
+}
+
+static int bench_rw(struct scull_dev *dev, int size_mb, void *buf, bool write)
+{
+	size_t size = (size_t)size_mb << 20;
+	u64 start = ktime_get_ns();
+
+	for (loff_t pos = 0; pos < size; pos += CHUNK) {
+		if (transfer(dev, buf, CHUNK, pos, write) != CHUNK) {
+			fprintf(stderr, "transfer failed at %lld\n",
+				(long long)pos);
+			return -1;
+		}
+	}
+	report(size_mb, write ? "write" : "read", ktime_get_ns() - start,
+	       size / CHUNK);
+	return 0;
+}
+
+static int bench_rread(struct scull_dev *dev, int size_mb, void *buf)
+{
+	u64 quanta = ((u64)size_mb << 20) / dev->quantum;
+	u64 start = ktime_get_ns();
+
+	for (int i = 0; i < RANDOM_OPS; i++) {
+		loff_t pos = xorshift64() % quanta * dev->quantum;
+
+		if (transfer(dev, buf, dev->quantum, pos, false) !=
+		    dev->quantum) {
+			return -1;
+		}
+	}
+	report(size_mb, "rread", ktime_get_ns() - start, RANDOM_OPS);
+	return 0;
+}
+
+static int bench_lookup(struct scull_dev *dev, int size_mb)
+{
+	u64 itemsize = (u64)dev->quantum * dev->qset;
+	u64 items = DIV_ROUND_UP((u64)size_mb << 20, itemsize);
+	u64 start = ktime_get_ns();
+
+	for (int i = 0; i < RANDOM_OPS; i++) {
+		if (!scull_follow(dev, xorshift64() % items)) {
+			return -1;
+		}
+	}
+	report(size_mb, "lookup", ktime_get_ns() - start, RANDOM_OPS);
+	return 0;
+}
+
+static void bench_trim(struct scull_dev *dev, int size_mb)
+{
+	u64 quanta = max_t(u64, dev->mem.quanta, 1);
+	u64 start = ktime_get_ns();
+
+	scull_trim(dev);
+	report(size_mb, "trim", ktime_get_ns() - start, quanta);
+}
+
+int main(int argc, char **argv)
+{
+	static const int default_sizes[] = { 1, 16, 256 };
+	int quantum = SCULL_QUANTUM;
+	int qset = SCULL_QSET;
+	int c;
+
+	while ((c = getopt(argc, argv, "q:Q:")) != -1) {
+		switch (c) {
+		case 'q':
+			quantum = atoi(optarg);
+			break;
+		case 'Q':
+			qset = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,
+				"usage: bench [-q quantum] [-Q qset] [size_mb...]\n");
+			return 2;
+		}
+	}
+
+	void *buf = malloc(max(CHUNK, quantum));
+	if (!buf || quantum < 1 || qset < 1) {
+		return 1;
+	}
+	memset(buf, 0x5a, max(CHUNK, quantum));
+
+	int nr_sizes = optind < argc ? argc - optind :
+				       (int)ARRAY_SIZE(default_sizes);
+
+	for (int i = 0; i < nr_sizes; i++) {
+		int size_mb = optind < argc ? atoi(argv[optind + i]) :
+					      default_sizes[i];
+		struct scull_dev *dev = uengine_dev_new(quantum, qset);
+
+		if (!dev || size_mb < 1) {
+			return 1;
+		}
+		if (bench_rw(dev, size_mb, buf, true) ||
+		    bench_rw(dev, size_mb, buf, false) ||
+		    bench_rread(dev, size_mb, buf) ||
+		    bench_lookup(dev, size_mb)) {
+			return 1;
+		}
+		bench_trim(dev, size_mb);
+		uengine_dev_free(dev);
+	}
+
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,178 @@
+#include <assert.h>
+#include <stdio.h>
+
+#include "../scull.h"
+
+/*
+ * Fuzz target of the storage engine.
+ *
+ * The input is the geometry of the device, two bytes, followed by
+ * operations of six bytes: opcode, offset and length (16 bit little
+ * endian), and an argument. Reads, writes, hole punching, preallocation
+ * and trims are checked against a flat copy of the device, and the memory
+ * counters against a walk of the qset list. A write or preallocation with
+ * the high bit of its argument set fails its allocations after the number
+ * given by the low bits.
+ *
+ * Built with libFuzzer by "make uengine-libfuzz". Built as a standalone
+ * program by "make uengine", it runs the inputs given as files, or random
+ * inputs.
+ */
+
+#define SHADOW_SIZE (1 << 16)
+
+enum { OP_WRITE, OP_READ, OP_PUNCH, OP_ALLOC, OP_TRIM, OP_CHECK, OP_NR };
+
+static u8 shadow[SHADOW_SIZE];
+static size_t shadow_size;
+static u8 buf[SHADOW_SIZE];
+
+static void check_mem(struct scull_dev *dev)
+{
+	struct scull_mem mem = { 0 };
+
+	for (struct scull_qset *dptr = dev->data; dptr; dptr = dptr->next) {
+		mem.meta_bytes += sizeof(*dptr);
+		if (dptr->gen) {
+			mem.meta_bytes += dev->qset * sizeof(u64);
+		}
+		if (!dptr->data) {
+			continue;
+		}
+		mem.meta_bytes += dev->qset * sizeof(char *);
+		for (int i = 0; i < dev->qset; i++) {
+			if (dptr->data[i]) {
+				mem.quanta++;
+				mem.data_bytes += dev->quantum;
+				mem.written += dptr->gen[i] != 0;
+			}
+		}
+	}
+
+	assert(mem.data_bytes == dev->mem.data_bytes);
+	assert(mem.meta_bytes == dev->mem.meta_bytes);
+	assert(mem.quanta == dev->mem.quanta);
+	assert(mem.written == dev->mem.written);
+}
+
+static void run_op(struct scull_dev *dev, const u8 *op)
+{
+	size_t pos = (op[1] | op[2] << 8) % (SHADOW_SIZE / 2);
+	size_t len = (op[3] | op[4] << 8) % (SHADOW_SIZE / 2);
+	u8 arg = op[5];
+	bool inject = arg & 0x80;
+	struct kvec kv = { .iov_base = buf, .iov_len = len };
+	struct iov_iter iter;
+	ssize_t ret;
+
+	if (inject) {
+		uengine_alloc_budget = arg & 0x7;
+	}
+
+	switch (op[0] % OP_NR) {
+	case OP_WRITE:
+		for (size_t i = 0; i < len; i++) {
+			buf[i] = arg + i;
+		}
+		iov_iter_kvec(&iter, ITER_SOURCE, &kv, 1, len);
+		ret = scull_copy_from_iter(dev, &iter, pos);
+		assert(ret >= 0 || (inject && ret == -ENOMEM));
+		if (ret > 0) {
+			memcpy(shadow + pos, buf, ret);
+			shadow_size = max(shadow_size, pos + ret);
+		}
+		assert(ret == len || inject);
+		break;
+	case OP_READ:
+		iov_iter_kvec(&iter, ITER_DEST, &kv, 1, len);
+		ret = scull_copy_to_iter(dev, &iter, pos);
+		assert(ret == (pos < shadow_size ?
+				       min(len, shadow_size - pos) : 0));
+		assert(!memcmp(buf, shadow + pos, ret));
+		break;
+	case OP_PUNCH:
+		assert(!scull_punch_hole(dev, pos, len));
+		memset(shadow + pos, 0, len);
+		break;
+	case OP_ALLOC:
+		ret = scull_alloc_range(dev, pos, len);
+		assert(!ret || (inject && ret == -ENOMEM));
+		break;
+	case OP_TRIM:
+		scull_trim(dev);
+		memset(shadow, 0, sizeof(shadow));
+		shadow_size = 0;
+		break;
+	case OP_CHECK:
+		check_mem(dev);
+		break;
+	}
+
+	uengine_alloc_budget = -1;
+	assert(dev->size == shadow_size);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	if (size < 2) {
+		return 0;
+	}
+
+	struct scull_dev *dev = uengine_dev_new(1 + data[0] % 64,
+						1 + data[1] % 16);
+	assert(dev);
+	memset(shadow, 0, sizeof(shadow));
+	shadow_size = 0;
+
+	for (size_t p = 2; p + 6 <= size; p += 6) {
+		run_op(dev, data + p);
+	}
+	check_mem(dev);
+
+	uengine_dev_free(dev);
+	return 0;
+}
+
+#ifdef UENGINE_STANDALONE
+
+static void run_file(const char *path)
+{
+	static u8 input[1 << 20];
+	FILE *f = fopen(path, "rb");
+
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	size_t n = fread(input, 1, sizeof(input), f);
+	fclose(f);
+
+	LLVMFuzzerTestOneInput(input, n);
+}
+
+int main(int argc, char **argv)
+{
+	static u8 input[2 + 6 * 256];
+
+	if (argc > 1) {
+		for (int i = 1; i < argc; i++) {
+			run_file(argv[i]);
+		}
+		return 0;
+	}
+
+	srand(1);
+	for (int n = 0; n < 1000; n++) {
+		size_t len = 2 + 6 * (rand() % 256);
+
+		for (size_t i = 0; i < len; i++) {
+			input[i] = rand();
+		}
+		LLVMFuzzerTestOneInput(input, len);
+	}
+	printf("1000 random inputs passed\n");
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,16 @@
+#pragma once
+
+/* Tracepoints compile to empty functions */
+
+#define TP_PROTO(args...) args
+#define TP_ARGS(args...) args
+
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)
+#define DEFINE_EVENT(template, name, proto, args) \
+	static inline void trace_##name(proto)    \
+	{                                         \
+	}
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print) \
+	static inline void trace_##name(proto)                 \
+	{                                                      \
+	}
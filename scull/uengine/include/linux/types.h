@@ -0,0 +1,3 @@
+#pragma once
+#include_next <linux/types.h>
+#include <uengine.h>
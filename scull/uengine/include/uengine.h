@@ -0,0 +1,276 @@
+#pragma once
+
+/*
+ * Userspace emulation of the part of the kernel API used by the storage
+ * engine, for benchmarking and fuzzing it as an ordinary program.
+ * Per CPU data has a single copy and locks are pthread mutexes.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t s64;
+typedef unsigned int gfp_t;
+
+#define __user
+#define __percpu
+#define __init
+#define __exit
+
+#define S_IRUGO 0444
+#define ERESTARTSYS 512
+#define GFP_KERNEL 0
+#define GFP_NOWAIT 0
+
+#define NSEC_PER_USEC 1000ull
+#define NSEC_PER_MSEC 1000000ull
+#define NSEC_PER_SEC 1000000000ull
+
+#define MINORBITS 20
+#define MINOR(dev) ((unsigned int)((dev) & ((1U << MINORBITS) - 1)))
+
+#define READ_ONCE(x) (*(const volatile typeof(x) *)&(x))
+#define WRITE_ONCE(x, val) (*(volatile typeof(x) *)&(x) = (val))
+
+#define min(a, b)                          \
+	({                                 \
+		typeof(a) _a = (a);        \
+		typeof(b) _b = (b);        \
+		_a < _b ? _a : _b;         \
+	})
+#define max(a, b)                          \
+	({                                 \
+		typeof(a) _a = (a);        \
+		typeof(b) _b = (b);        \
+		_a > _b ? _a : _b;         \
+	})
+#define min_t(type, a, b) min((type)(a), (type)(b))
+#define max_t(type, a, b) max((type)(a), (type)(b))
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define BITS_PER_LONG (8 * sizeof(long))
+#define BITS_TO_LONGS(n) DIV_ROUND_UP(n, BITS_PER_LONG)
+
+#define _THIS_IP_                                   \
+	({                                          \
+		__label__ __here;                   \
+	__here:                                     \
+		(unsigned long)&&__here;            \
+	})
+
+static inline int fls64(u64 x)
+{
+	return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+static inline bool test_bit(long nr, const unsigned long *addr)
+{
+	return addr[nr / BITS_PER_LONG] >> (nr % BITS_PER_LONG) & 1;
+}
+
+static inline void __set_bit(long nr, unsigned long *addr)
+{
+	addr[nr / BITS_PER_LONG] |= 1UL << (nr % BITS_PER_LONG);
+}
+
+static inline void __clear_bit(long nr, unsigned long *addr)
+{
+	addr[nr / BITS_PER_LONG] &= ~(1UL << (nr % BITS_PER_LONG));
+}
+
+static inline bool __test_and_set_bit(long nr, unsigned long *addr)
+{
+	bool old = test_bit(nr, addr);
+
+	__set_bit(nr, addr);
+	return old;
+}
+
+/* errors */
+
+#define MAX_ERRNO 4095
+#define IS_ERR_VALUE(x) ((unsigned long)(x) >= (unsigned long)-MAX_ERRNO)
+
+static inline void *ERR_PTR(long error)
+{
+	return (void *)error;
+}
+
+static inline long PTR_ERR(const void *ptr)
+{
+	return (long)ptr;
+}
+
+static inline bool IS_ERR(const void *ptr)
+{
+	return IS_ERR_VALUE(ptr);
+}
+
+/* module */
+
+#define module_param(name, type, perm)
+#define MODULE_LICENSE(license)
+
+/* slab */
+
+/* Number of allocations that succeed before the next one fails, -1 for all */
+extern long uengine_alloc_budget;
+
+void *kzalloc(size_t size, int flags);
+
+static inline void kfree(const void *p)
+{
+	free((void *)p);
+}
+
+/* page allocator */
+
+#define PAGE_SIZE 4096ul
+#define PAGE_ALIGNED(x) (((unsigned long)(x) & (PAGE_SIZE - 1)) == 0)
+#define __GFP_ZERO 0x100
+#define __GFP_NOWARN 0x200
+
+void *alloc_pages_exact(size_t size, int flags);
+
+static inline void free_pages_exact(void *p, size_t size)
+{
+	free(p);
+}
+
+/* percpu */
+
+#define alloc_percpu(type) ((type *)calloc(1, sizeof(type)))
+#define free_percpu(p) free(p)
+#define per_cpu_ptr(p, cpu) (p)
+#define this_cpu_inc(x) ((x)++)
+#define this_cpu_add(x, n) ((x) += (n))
+
+/* time */
+
+static inline u64 ktime_get_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* locks */
+
+struct mutex {
+	pthread_mutex_t m;
+};
+
+static inline void mutex_init(struct mutex *lock)
+{
+	pthread_mutex_init(&lock->m, NULL);
+}
+
+static inline void mutex_lock(struct mutex *lock)
+{
+	pthread_mutex_lock(&lock->m);
+}
+
+static inline int mutex_lock_interruptible(struct mutex *lock)
+{
+	pthread_mutex_lock(&lock->m);
+	return 0;
+}
+
+static inline int mutex_trylock(struct mutex *lock)
+{
+	return !pthread_mutex_trylock(&lock->m);
+}
+
+static inline void mutex_unlock(struct mutex *lock)
+{
+	pthread_mutex_unlock(&lock->m);
+}
+
+typedef struct {
+	pthread_mutex_t m;
+} spinlock_t;
+
+/* types only referenced by struct scull_dev */
+
+struct cdev {
+	dev_t dev;
+};
+
+/* only passed around by the character device */
+struct file;
+struct kiocb;
+
+struct work_struct {
+	void (*func)(struct work_struct *work);
+};
+
+struct delayed_work {
+	struct work_struct work;
+};
+
+typedef struct {
+	int counter;
+} atomic_t;
+
+struct dentry;
+
+typedef struct mempool_s mempool_t;
+
+/* iov_iter, over kvecs only */
+
+#define ITER_SOURCE 1
+#define ITER_DEST 0
+
+struct kvec {
+	void *iov_base;
+	size_t iov_len;
+};
+
+struct iov_iter {
+	bool source;
+	const struct kvec *kvec;
+	unsigned long nr_segs;
+	size_t iov_offset;
+	size_t count;
+};
+
+void iov_iter_kvec(struct iov_iter *i, unsigned int direction,
+		   const struct kvec *kvec, unsigned long nr_segs,
+		   size_t count);
+size_t copy_to_iter(const void *addr, size_t bytes, struct iov_iter *i);
+size_t copy_from_iter(void *addr, size_t bytes, struct iov_iter *i);
+#define copy_from_iter_nocache copy_from_iter
+size_t iov_iter_zero(size_t bytes, struct iov_iter *i);
+
+static inline size_t iov_iter_count(const struct iov_iter *i)
+{
+	return i->count;
+}
+
+/* kvecs are always in memory */
+static inline size_t fault_in_iov_iter_readable(const struct iov_iter *i,
+						size_t size)
+{
+	return 0;
+}
+
+/* devices for the userspace programs */
+
+struct scull_dev;
+
+struct scull_dev *uengine_dev_new(int quantum, int qset);
+void uengine_dev_free(struct scull_dev *dev);
@@ -0,0 +1,210 @@
+#include <stdio.h>
+
+#include "../scull.h"
+
+/*
+ * Userspace implementation of the emulated kernel API, and stubs of the
+ * parts of the module the storage engine calls into but that are not built
+ * here. Devices are in memory only, without cache, movable quanta, reserve,
+ * heat map or lock instrumentation.
+ */
+
+long uengine_alloc_budget = -1;
+
+void *kzalloc(size_t size, int flags)
+{
+	if (!uengine_alloc_budget) {
+		return NULL;
+	}
+	if (uengine_alloc_budget > 0) {
+		uengine_alloc_budget--;
+	}
+	return calloc(1, size);
+}
+
+void *alloc_pages_exact(size_t size, int flags)
+{
+	void *p = NULL;
+
+	if (!uengine_alloc_budget) {
+		return NULL;
+	}
+	if (uengine_alloc_budget > 0) {
+		uengine_alloc_budget--;
+	}
+	if (!posix_memalign(&p, PAGE_SIZE, size)) {
+		memset(p, 0, size);
+	}
+	return p;
+}
+
+void iov_iter_kvec(struct iov_iter *i, unsigned int direction,
+		   const struct kvec *kvec, unsigned long nr_segs, size_t count)
+{
+	i->source = direction == ITER_SOURCE;
+	i->kvec = kvec;
+	i->nr_segs = nr_segs;
+	i->iov_offset = 0;
+	i->count = count;
+}
+
+/*
+ * Transfer bytes between addr and the iterator, addr being NULL to zero
+ * the destination.
+ */
+static size_t iov_iter_transfer(void *addr, size_t bytes, struct iov_iter *i)
+{
+	size_t done = 0;
+
+	bytes = min(bytes, i->count);
+	while (done < bytes) {
+		const struct kvec *kv = i->kvec;
+		size_t n = min(bytes - done, kv->iov_len - i->iov_offset);
+		char *seg = (char *)kv->iov_base + i->iov_offset;
+
+		if (i->source) {
+			memcpy((char *)addr + done, seg, n);
+		} else if (addr) {
+			memcpy(seg, (char *)addr + done, n);
+		} else {
+			memset(seg, 0, n);
+		}
+
+		done += n;
+		i->count -= n;
+		i->iov_offset += n;
+		if (i->iov_offset == kv->iov_len) {
+			i->kvec++;
+			i->nr_segs--;
+			i->iov_offset = 0;
+		}
+	}
+
+	return done;
+}
+
+size_t copy_to_iter(const void *addr, size_t bytes, struct iov_iter *i)
+{
+	return i->source ? 0 : iov_iter_transfer((void *)addr, bytes, i);
+}
+
+size_t copy_from_iter(void *addr, size_t bytes, struct iov_iter *i)
+{
+	return i->source ? iov_iter_transfer(addr, bytes, i) : 0;
+}
+
+size_t iov_iter_zero(size_t bytes, struct iov_iter *i)
+{
+	return i->source ? 0 : iov_iter_transfer(NULL, bytes, i);
+}
+
+struct scull_dev *uengine_dev_new(int quantum, int qset)
+{
+	struct scull_dev *dev = calloc(1, sizeof(*dev));
+
+	if (!dev) {
+		return NULL;
+	}
+
+	dev->quantum = scull_quantum = quantum;
+	dev->qset = scull_qset = qset;
+	mutex_init(&dev->lock);
+	dev->stats = alloc_percpu(struct scull_stats);
+	dev->lat = alloc_percpu(struct scull_latency);
+	if (!dev->stats || !dev->lat) {
+		uengine_dev_free(dev);
+		return NULL;
+	}
+
+	return dev;
+}
+
+void uengine_dev_free(struct scull_dev *dev)
+{
+	scull_trim(dev);
+	free_percpu(dev->lat);
+	free_percpu(dev->stats);
+	free(dev);
+}
+
+/* Not built in userspace */
+
+unsigned int scull_lock_warn_us;
+
+void scull_lock_held_long(struct scull_dev *dev, u64 held)
+{
+}
+
+int scull_cache_fault(struct scull_dev *dev, struct scull_qset *dptr, int s_pos,
+		      loff_t pos)
+{
+	fprintf(stderr, "uengine: no cache mode\n");
+	abort();
+}
+
+void scull_cache_dirty(struct scull_dev *dev, struct scull_qset *dptr,
+		       int s_pos)
+{
+}
+
+int scull_cache_discard(struct scull_dev *dev, loff_t pos, loff_t len)
+{
+	abort();
+}
+
+void scull_cache_drop(struct scull_dev *dev, struct scull_qset *dptr,
+		      int s_pos)
+{
+	abort();
+}
+
+void scull_cache_trim(struct scull_dev *dev)
+{
+}
+
+void sbull_trim(struct scull_dev *dev)
+{
+}
+
+bool scull_movable(struct scull_dev *dev)
+{
+	return false;
+}
+
+void *scull_movable_alloc(gfp_t gfp)
+{
+	abort();
+}
+
+void scull_movable_adopt(struct scull_dev *dev, void *data, void **slot)
+{
+	abort();
+}
+
+void scull_movable_free(void *data)
+{
+	abort();
+}
+
+void scull_reserve_refill(struct scull_dev *dev)
+{
+}
+
+void *scull_reserve_quantum(struct scull_dev *dev)
+{
+	return NULL;
+}
+
+void *scull_reserve_meta(struct scull_dev *dev, size_t size)
+{
+	return NULL;
+}
+
+void scull_heat_record(struct scull_dev *dev, bool write, loff_t pos,
+		       size_t len)
+{
+}
+
+void scull_heat_reset(struct scull_dev *dev)
+{
+}